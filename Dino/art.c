@@ -0,0 +1,178 @@
+/*
+ * Sprite pattern art
+ *
+ * Each pattern is drawn at 16x16 and scaled to the configured tile size.
+ * '#' is ART_INK; everything else is transparent.  Obstacles are
+ * drawn centered on their hit boxes in the middle of the pattern.
+ */
+
+#include <string.h>
+#include "vga_ball.h"
+#include "art.h"
+
+#define ART_SIZE 16
+
+static const char *const art[ART_NPATTERNS][ART_SIZE] = {
+    [ART_DINO_RUN0] = {
+        "........#######.",
+        ".......##.######",
+        ".......#########",
+        ".......#########",
+        ".......#####....",
+        ".......#######..",
+        "#.....#####.....",
+        "#....#######....",
+        "##..#########...",
+        "###.########.#..",
+        ".###########....",
+        "..#########.....",
+        "...#######......",
+        "....###.##......",
+        "....##...#......",
+        "....#....##.....",
+    },
+    [ART_DINO_RUN1] = {
+        "........#######.",
+        ".......##.######",
+        ".......#########",
+        ".......#########",
+        ".......#####....",
+        ".......#######..",
+        "#.....#####.....",
+        "#....#######....",
+        "##..#########...",
+        "###.########.#..",
+        ".###########....",
+        "..#########.....",
+        "...#######......",
+        "....###.##......",
+        "....#...##......",
+        "....##..........",
+    },
+    [ART_DINO_JUMP] = {
+        "........#######.",
+        ".......##.######",
+        ".......#########",
+        ".......#########",
+        ".......#####....",
+        ".......#######..",
+        "#.....#####.....",
+        "#....#######....",
+        "##..#########...",
+        "###.########.#..",
+        ".###########....",
+        "..#########.....",
+        "...#######......",
+        "....###.##......",
+        "....##...##.....",
+        "....#.....#.....",
+    },
+    [ART_DINO_DUCK] = {
+        "................",
+        "................",
+        "................",
+        "................",
+        "................",
+        "................",
+        "#...............",
+        "##.....#########",
+        "###.#####.######",
+        ".###############",
+        "..##############",
+        "...#########....",
+        "....######......",
+        "....##.##.......",
+        "....#...##......",
+        "....##..........",
+    },
+    [ART_CACTUS] = {
+        "................",
+        "................",
+        "................",
+        ".......##.......",
+        ".......##.......",
+        "....#..##.......",
+        "....#..##..#....",
+        "....#..##..#....",
+        "....#####..#....",
+        ".......######...",
+        ".......##.......",
+        ".......##.......",
+        ".......##.......",
+        "................",
+        "................",
+        "................",
+    },
+    [ART_TALL_CACTUS] = {
+        ".......##.......",
+        "......####......",
+        "......####......",
+        "..#...####......",
+        ".###..####..#...",
+        ".###..####.###..",
+        ".###..####.###..",
+        ".#########.###..",
+        "..########.###..",
+        "......#######...",
+        "......######....",
+        "......####......",
+        "......####......",
+        "......####......",
+        "......####......",
+        "......####......",
+    },
+    [ART_BIRD0] = {
+        "................",
+        "................",
+        "................",
+        "................",
+        "......#.........",
+        "......##........",
+        "...#..###.......",
+        "..##..####......",
+        "#############...",
+        "....##########..",
+        "......#######...",
+        "................",
+        "................",
+        "................",
+        "................",
+        "................",
+    },
+    [ART_BIRD1] = {
+        "................",
+        "................",
+        "................",
+        "................",
+        "................",
+        "................",
+        "...#............",
+        "..##............",
+        "#############...",
+        "....##########..",
+        "......####......",
+        "......###.......",
+        "......##........",
+        "......#.........",
+        "................",
+        "................",
+    },
+};
+
+void art_patterns(unsigned char *dst) {
+    memset(dst, 0, ART_NPATTERNS * VGA_BALL_TILE_BYTES);
+    for (int p = 0; p < ART_NPATTERNS; p++) {
+        unsigned char *pattern = dst + p * VGA_BALL_TILE_BYTES;
+
+        if (art[p][0] == NULL) {
+            continue;
+        }
+        for (int y = 0; y < VGA_BALL_TILE_SIZE; y++) {
+            for (int x = 0; x < VGA_BALL_TILE_SIZE; x++) {
+                if (art[p][y * ART_SIZE / VGA_BALL_TILE_SIZE][x * ART_SIZE / VGA_BALL_TILE_SIZE] == '#') {
+                    pattern[y * VGA_BALL_TILE_SIZE + x] = ART_INK;
+                }
+            }
+        }
+    }
+}
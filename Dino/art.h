@@ -0,0 +1,30 @@
+/*
+ * Sprite patterns for the dino and the obstacles, drawn at startup and
+ * uploaded to the display's pattern memory.
+ */
+
+#ifndef _ART_H
+#define _ART_H
+
+/* Palette entries the art is drawn with */
+#define ART_INK  1           // everything in the patterns and ground tiles
+#define ART_SKY  2           // the background, with a palette
+
+/* Pattern numbers, as used in sprite tile fields; 0 is left blank */
+enum {
+    ART_BLANK,
+    ART_DINO_RUN0,           // run cycle, two frames
+    ART_DINO_RUN1,
+    ART_DINO_JUMP,
+    ART_DINO_DUCK,
+    ART_CACTUS,
+    ART_TALL_CACTUS,
+    ART_BIRD0,               // wings up
+    ART_BIRD1,               // wings down
+    ART_NPATTERNS
+};
+
+/* Draw every pattern into dst, ART_NPATTERNS x VGA_BALL_TILE_BYTES */
+void art_patterns(unsigned char *dst);
+
+#endif
@@ -0,0 +1,447 @@
+/*
+ * Frame-timing benchmark for /dev/vga_ball
+ *
+ * Drives ball position updates through one of the update paths, first in a
+ * tight loop and then paced to a target frame rate, and reports per-update
+ * latency, achieved rate and how late each paced frame woke up.  A
+ * recording from hello -R can stand in for the synthetic updates, so every
+ * path gets the same load.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/ioctl.h>
+#include <time.h>
+#include "vgaball.h"
+#include "rt.h"
+#include "replay.h"
+
+struct vgaball vb;  // the display, through the backend being measured
+
+/* Where hello starts the ball; updates bounce it up from there */
+#define BENCH_X (VGA_BALL_TILE_SIZE / 2)
+#define BENCH_Y (VGA_BALL_HEIGHT - 4 * VGA_BALL_TILE_SIZE - VGA_BALL_TILE_SIZE / 2)
+
+static long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* Push one position update through the backend; returns 0 or -1 */
+static int update(const vga_ball_pos_t *pos) {
+    vga_ball_frame_t frame;
+
+    frame.position = *pos;
+    frame.dirty = VGA_BALL_DIRTY_POS;
+    return vgaball_frame(&vb, &frame);
+}
+
+static int cmp_ll(const void *a, const void *b) {
+    long long x = *(const long long *)a, y = *(const long long *)b;
+    return (x > y) - (x < y);
+}
+
+/* Print p50/p99/max of n samples (sorts them), scaled down by div */
+static void report(const char *what, long long *v, int n, long long div) {
+    if (n == 0) {
+        return;
+    }
+    qsort(v, n, sizeof(*v), cmp_ll);
+    printf("  %s: p50 %lld p99 %lld max %lld\n", what,
+           v[n / 2] / div, v[(int)(n * 0.99)] / div, v[n - 1] / div);
+}
+
+/*
+ * Issue n updates back to back.  Backends that queue can turn updates
+ * away when the queue is full; those are counted, not treated as errors.
+ */
+static int run_tight(int n, long long *lat) {
+    vga_ball_pos_t pos = { BENCH_X, BENCH_Y };
+    long long start, t0, t1;
+    int full = 0;
+
+    start = now_ns();
+    for (int i = 0; i < n; i++) {
+        pos.ycoor = BENCH_Y - (i % VGA_BALL_JUMP_HEIGHT);
+        t0 = now_ns();
+        if (update(&pos) < 0) {
+            if (errno != EAGAIN) {
+                perror("update failed");
+                return -1;
+            }
+            full++;
+        }
+        t1 = now_ns();
+        lat[i] = t1 - t0;
+    }
+    t1 = now_ns();
+
+    printf("%s, tight loop: %d updates in %.3f ms, %.0f updates/s, %d turned away\n",
+           vgaball_backend_name(&vb), n, (t1 - start) / 1e6, n * 1e9 / (t1 - start), full);
+    report("latency ns", lat, n, 1);
+    return 0;
+}
+
+/* Issue n updates, one per period, against absolute deadlines */
+static int run_paced(int n, int rate, long long *lat, long long *late) {
+    vga_ball_pos_t pos = { BENCH_X, BENCH_Y };
+    long long period = 1000000000LL / rate;
+    long long start, deadline, t0, t1;
+    struct timespec ts;
+    int missed = 0;
+
+    start = now_ns();
+    deadline = start;
+    for (int i = 0; i < n; i++) {
+        deadline += period;
+        ts.tv_sec = deadline / 1000000000LL;
+        ts.tv_nsec = deadline % 1000000000LL;
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+            ;
+
+        t0 = now_ns();
+        late[i] = t0 - deadline;
+        if (late[i] >= period) {
+            missed++;
+        }
+        pos.ycoor = BENCH_Y - (i % VGA_BALL_JUMP_HEIGHT);
+        if (update(&pos) < 0) {
+            perror("update failed");
+            return -1;
+        }
+        t1 = now_ns();
+        lat[i] = t1 - t0;
+    }
+    t1 = now_ns();
+
+    printf("%s, paced at %d/s: %d frames in %.3f s, %.2f fps, %d missed deadlines\n",
+           vgaball_backend_name(&vb), rate, n, (t1 - start) / 1e9, n * 1e9 / (t1 - start), missed);
+    report("latency ns", lat, n, 1);
+    report("deadline overshoot us", late, n, 1000);
+    return 0;
+}
+
+/* Time from issuing an update to the vblank that commits it, n times */
+static int run_display(int n, long long *lat) {
+    vga_ball_pos_t pos = { BENCH_X, BENCH_Y };
+    vga_ball_timing_t timing;
+    unsigned int frame;
+    long long t0;
+
+    if (vgaball_fd(&vb) < 0) {
+        fprintf(stderr, "%s: no vblanks to measure against\n", vgaball_backend_name(&vb));
+        return -1;
+    }
+    // Start just after a vblank, with none pending for read()
+    if (ioctl(vgaball_fd(&vb), VGA_BALL_WAIT_VSYNC, &frame) < 0) {
+        perror("ioctl(VGA_BALL_WAIT_VSYNC) failed");
+        return -1;
+    }
+    for (int i = 0; i < n; i++) {
+        pos.ycoor = BENCH_Y - (i % VGA_BALL_JUMP_HEIGHT);
+        t0 = now_ns();
+        if (update(&pos) < 0) {
+            perror("update failed");
+            return -1;
+        }
+        // A vblank that slipped in before the update doesn't count
+        do {
+            if (read(vgaball_fd(&vb), &frame, sizeof(frame)) != sizeof(frame) ||
+                ioctl(vgaball_fd(&vb), VGA_BALL_READ_TIMING, &timing) < 0) {
+                perror("waiting for vblank failed");
+                return -1;
+            }
+        } while ((long long)timing.vblank_ns < t0);
+        lat[i] = timing.vblank_ns - t0;
+    }
+
+    printf("%s, update to vblank: %d frames\n", vgaball_backend_name(&vb), n);
+    report("latency us", lat, n, 1000);
+    return 0;
+}
+
+/* Whether a record is a register update bench can issue */
+static int replayable(const struct replay_record *rec) {
+    switch (rec->type) {
+    case REPLAY_UPDATE:
+        return rec->arg < VGA_BALL_NFIELDS;
+    case REPLAY_SPRITES:
+        return rec->arg < VGA_BALL_MAX_SPRITES;
+    case REPLAY_PALETTE:
+        return 1;  // an 8-bit entry number always fits
+    default:
+        return 0;
+    }
+}
+
+/*
+ * Read the register updates out of a recording, before anything is timed.
+ * Returns how many there are, with *updates allocated, or -1.
+ */
+static int load_updates(struct replay *r, struct replay_record **updates) {
+    struct replay_record rec, *p;
+    int n = 0, size = 0;
+
+    *updates = NULL;
+    while (replay_next(r, ~0UL, &rec) > 0) {
+        if (!replayable(&rec)) {
+            continue;
+        }
+        if (n == size) {
+            size = size ? 2 * size : 4096;
+            p = realloc(*updates, size * sizeof(*p));
+            if (p == NULL) {
+                perror("realloc");
+                free(*updates);
+                return -1;
+            }
+            *updates = p;
+        }
+        (*updates)[n++] = rec;
+    }
+    return n;
+}
+
+/* One tick's recorded updates, gathered before they are issued */
+struct tick_updates {
+    vga_ball_frame_t frame;
+    vga_ball_sprite_t sprites[VGA_BALL_MAX_SPRITES];
+    unsigned int colors[VGA_BALL_PALETTE_SIZE];
+    unsigned char sprite_set[VGA_BALL_MAX_SPRITES];  // sprites[i] was written
+    unsigned char color_set[VGA_BALL_PALETTE_SIZE];  // colors[i] was written
+    int any;
+};
+
+static void gather_update(struct tick_updates *t, const struct replay_record *rec) {
+    vga_ball_sprite_t *sp;
+
+    switch (rec->type) {
+    case REPLAY_UPDATE:
+        vgaball_set_field(&t->frame, rec->arg, rec->value);
+        break;
+    case REPLAY_SPRITES:
+        sp = &t->sprites[rec->arg];
+        sp->xcoor = (short)(rec->value & 0xffff);
+        sp->ycoor = (short)(rec->value >> 16);
+        sp->tile = rec->attr & 0xff;
+        sp->flags = rec->attr >> 8;
+        t->sprite_set[rec->arg] = 1;
+        break;
+    case REPLAY_PALETTE:
+        t->colors[rec->arg] = rec->value;
+        t->color_set[rec->arg] = 1;
+        break;
+    }
+    t->any = 1;
+}
+
+/*
+ * Send a tick's updates in the order the game does, frame, palette, then
+ * sprites, each run of consecutive entries in one call, and present it.
+ */
+static int issue_updates(const struct tick_updates *t) {
+    vga_ball_sprites_t sprites;
+    unsigned int i, j;
+
+    if (t->frame.dirty && vgaball_frame(&vb, &t->frame) < 0) {
+        return -1;
+    }
+    for (i = 0; i < VGA_BALL_PALETTE_SIZE; i = j) {
+        for (; i < VGA_BALL_PALETTE_SIZE && !t->color_set[i]; i++)
+            ;
+        for (j = i; j < VGA_BALL_PALETTE_SIZE && t->color_set[j]; j++)
+            ;
+        if (j > i && vgaball_palette(&vb, i, j - i, &t->colors[i]) < 0) {
+            return -1;
+        }
+    }
+    for (i = 0; i < VGA_BALL_MAX_SPRITES; i = j) {
+        for (; i < VGA_BALL_MAX_SPRITES && !t->sprite_set[i]; i++)
+            ;
+        for (j = i; j < VGA_BALL_MAX_SPRITES && t->sprite_set[j]; j++)
+            ;
+        if (j > i) {
+            sprites.first = i;
+            sprites.count = j - i;
+            memcpy(sprites.sprites, &t->sprites[i], (j - i) * sizeof(sprites.sprites[0]));
+            if (vgaball_sprites(&vb, &sprites) < 0) {
+                return -1;
+            }
+        }
+    }
+    return vgaball_present(&vb);
+}
+
+/*
+ * Issue the recorded updates, each tick's together, one tick per period at
+ * speed times the recorded rate, or back to back with speed 0.  lat has
+ * room for one sample per tick.
+ */
+static int run_replay(const struct replay_record *updates, int n,
+                      unsigned int hz, double speed, long long *lat, long long *late) {
+    long long period = speed > 0 ? (long long)(1e9 / (hz * speed)) : 0;
+    long long start, deadline, t0, t1;
+    struct tick_updates t;
+    struct timespec ts;
+    int i = 0, frames = 0, missed = 0;
+
+    memset(&t, 0, sizeof(t));
+    start = now_ns();
+    deadline = start;
+    for (unsigned long tick = updates[0].tick; i < n; tick++) {
+        t.frame.dirty = 0;
+        memset(t.sprite_set, 0, sizeof(t.sprite_set));
+        memset(t.color_set, 0, sizeof(t.color_set));
+        t.any = 0;
+        for (; i < n && updates[i].tick == tick; i++) {
+            gather_update(&t, &updates[i]);
+        }
+        if (period) {
+            deadline += period;
+            ts.tv_sec = deadline / 1000000000LL;
+            ts.tv_nsec = deadline % 1000000000LL;
+            while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+                ;
+        }
+        if (!t.any) {
+            continue;  // a tick the game sent nothing on
+        }
+
+        t0 = now_ns();
+        if (period) {
+            late[frames] = t0 - deadline;
+            if (late[frames] >= period) {
+                missed++;
+            }
+        }
+        if (issue_updates(&t) < 0) {
+            perror("update failed");
+            return -1;
+        }
+        t1 = now_ns();
+        lat[frames++] = t1 - t0;
+    }
+    t1 = now_ns();
+
+    if (period) {
+        printf("%s, replay at %gx: ", vgaball_backend_name(&vb), speed);
+    } else {
+        printf("%s, replay flat out: ", vgaball_backend_name(&vb));
+    }
+    printf("%d frames, %d updates in %.3f s, %d missed deadlines\n",
+           frames, n, (t1 - start) / 1e9, missed);
+    report("latency ns", lat, frames, 1);
+    if (period) {
+        report("deadline overshoot us", late, frames, 1000);
+    }
+    return 0;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "usage: %s [-m backend] [-n updates] [-f frames] [-r rate] [-l frames] [-R] [-d device]\n"
+            "          [-P file [-x speed]]\n"
+            "  -m  backend to measure: ioctl, frame, write, ring, mmap, null\n"
+            "      or sim (default ioctl)\n"
+            "  -n  updates in the tight loop (default 100000)\n"
+            "  -f  frames in the paced loop, 0 to skip it (default 600)\n"
+            "  -r  paced loop frame rate (default 60)\n"
+            "  -l  frames to measure update-to-vblank latency over (default 0)\n"
+            "  -R  run with SCHED_FIFO and locked memory\n"
+            "  -d  display to drive (default /dev/vga_ball)\n"
+            "  -P  replay the register updates of a hello -R recording instead\n"
+            "  -x  replay speed, times the recorded rate, 0 for flat out (default 1)\n",
+            prog);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]) {
+    const char *device = "/dev/vga_ball";
+    const char *backend = "ioctl";
+    int n = 100000, frames = 600, rate = 60, display = 0;
+    const char *play_path = NULL;
+    struct replay play;
+    struct replay_record *updates = NULL;
+    double speed = 1;
+    long long *lat, *late;
+    int opt, ret, realtime = 0, nupdates = 0;
+
+    while ((opt = getopt(argc, argv, "m:n:f:r:l:Rd:P:x:")) != -1) {
+        switch (opt) {
+        case 'm': backend = optarg; break;
+        case 'n': n = atoi(optarg); break;
+        case 'f': frames = atoi(optarg); break;
+        case 'r': rate = atoi(optarg); break;
+        case 'l': display = atoi(optarg); break;
+        case 'R': realtime = 1; break;
+        case 'd': device = optarg; break;
+        case 'P': play_path = optarg; break;
+        case 'x': speed = atof(optarg); break;
+        default: usage(argv[0]);
+        }
+    }
+    if (n < 0 || frames < 0 || rate <= 0 || display < 0 || speed < 0) {
+        usage(argv[0]);
+    }
+
+    if (play_path) {
+        if (replay_open(&play, play_path) < 0) {
+            return EXIT_FAILURE;
+        }
+        nupdates = load_updates(&play, &updates);
+        replay_close(&play);
+        if (nupdates <= 0) {
+            fprintf(stderr, "%s: no register updates recorded\n", play_path);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (vgaball_open(&vb, device, backend) < 0) {
+        fprintf(stderr, "could not open %s through %s: %s\n", device,
+                backend ? backend : "the default backends", strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    // Sample buffers are allocated up front so the loops don't touch malloc
+    int samples = n > frames ? n : frames;
+    if (display > samples) {
+        samples = display;
+    }
+    // A replay issues at most one frame per recorded update
+    if (play_path) {
+        samples = nupdates;
+    }
+    lat = calloc(samples ? samples : 1, sizeof(*lat));
+    late = calloc(samples ? samples : 1, sizeof(*late));
+    if (lat == NULL || late == NULL) {
+        perror("calloc");
+        return EXIT_FAILURE;
+    }
+
+    if (realtime && rt_setup(RT_DEFAULT_PRIORITY, -1) < 0) {
+        return EXIT_FAILURE;
+    }
+
+    if (play_path) {
+        ret = run_replay(updates, nupdates, play.hdr.hz, speed, lat, late);
+        goto done;
+    }
+    ret = run_tight(n, lat);
+    if (ret == 0 && frames > 0) {
+        ret = run_paced(frames, rate, lat, late);
+    }
+    if (ret == 0 && display > 0) {
+        ret = run_display(display, lat);
+    }
+
+done:
+    free(updates);
+    free(lat);
+    free(late);
+    vgaball_close(&vb);
+    return ret ? EXIT_FAILURE : 0;
+}
@@ -1,201 +1,549 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <fcntl.h>
 #include <unistd.h>
-#include <termios.h>
 #include <poll.h>
 #include <errno.h>
-#include <sys/ioctl.h>
 #include <time.h>
-#include "vga_ball.h"
+#include "vgaball.h"
+#include "motion.h"
+#include "rt.h"
+#include "pace.h"
+#include "input.h"
+#include "world.h"
+#include "replay.h"
 
-int vga_ball_fd;  // File descriptor for /dev/vga_ball
+struct vgaball vb;        // the display, through whichever backend was configured
+struct replay *recorder;  // where to record what the game does, or NULL
+unsigned long game_tick;  // game ticks run so far, to timestamp the recording
 
-/* Set the background color via ioctl */
-void set_background_color(const vga_ball_color_t *color) {
-    vga_ball_arg_t arg;
-    arg.background = *color;
-    if (ioctl(vga_ball_fd, VGA_BALL_WRITE_BACKGROUND, &arg) < 0) {
-        perror("ioctl(VGA_BALL_WRITE_BACKGROUND) failed");
+/* Send the dirty fields of a frame, all shown at the same vblank */
+void set_frame(const vga_ball_frame_t *frame) {
+    if (vgaball_frame(&vb, frame) < 0) {
+        perror("frame update failed");
+    }
+    if (recorder) {
+        replay_frame(recorder, game_tick, frame);
     }
 }
 
-/* Set the ball position via ioctl */
-void set_pos(const vga_ball_pos_t *pos) {
-    if (ioctl(vga_ball_fd, VGA_BALL_WRITE_POS, pos) < 0) {
-        perror("ioctl(VGA_BALL_WRITE_POS) failed");
+/* Set palette entries first .. first + count - 1 */
+void set_palette(unsigned int first, unsigned int count, const unsigned int *colors) {
+    if (vgaball_palette(&vb, first, count, colors) < 0) {
+        perror("palette update failed");
+    }
+    if (recorder) {
+        replay_palette(recorder, game_tick, first, count, colors);
     }
 }
 
-// Function to handle smooth animation for jumping and ducking
-void animate_movement(vga_ball_pos_t *pos, int start_y, int target_y) {
-    struct timespec start_time, current_time;
-    double elapsed_time, animation_duration = 0.6; // 0.6 second for full animation (increased speed)
-    int current_y;
-    
-    // Get the current time as start time
-    clock_gettime(CLOCK_MONOTONIC, &start_time);
-    
-    // Animation loop
-    do {
-        // Get current time
-        clock_gettime(CLOCK_MONOTONIC, &current_time);
-        
-        // Calculate elapsed time in seconds
-        elapsed_time = (current_time.tv_sec - start_time.tv_sec) + 
-                      (current_time.tv_nsec - start_time.tv_nsec) / 1000000000.0;
-        
-        if (elapsed_time < animation_duration / 2) {
-            // First half of animation - moving to target position
-            double progress = elapsed_time / (animation_duration / 2);
-            current_y = start_y + (int)((target_y - start_y) * progress);
-        } else if (elapsed_time < animation_duration) {
-            // Second half of animation - returning to starting position
-            double progress = (elapsed_time - animation_duration / 2) / (animation_duration / 2);
-            current_y = target_y + (int)((start_y - target_y) * progress);
+/* Ink and sky, from ART_INK on, by day and by night */
+#define DAY_NIGHT_PX 8000   // pixels scrolled between day and night
+static const unsigned int day_colors[] = {
+    VGA_BALL_PACK_RGB(0x53, 0x53, 0x53), VGA_BALL_PACK_RGB(0xf7, 0xf7, 0xf7),
+};
+static const unsigned int night_colors[] = {
+    VGA_BALL_PACK_RGB(0xe0, 0xe0, 0xe0), VGA_BALL_PACK_RGB(0x20, 0x22, 0x30),
+};
+
+/* Set sprite table entries */
+void set_sprites(const vga_ball_sprites_t *sprites) {
+    if (vgaball_sprites(&vb, sprites) < 0) {
+        perror("sprite update failed");
+    }
+    if (recorder) {
+        replay_sprites(recorder, game_tick, sprites);
+    }
+}
+
+/*
+ * Set up the palette, and upload the ground's tilemap and tiles and the
+ * sprite patterns through the staging buffer.  Returns the VGA_BALL_DIRTY_*
+ * registers the game loop can use: the ground scroll and the ball's
+ * pattern, if uploaded.
+ */
+unsigned int setup_video(const struct world *world, unsigned int caps) {
+    const unsigned int map_len = VGA_BALL_TILEMAP_ROWS * VGA_BALL_TILEMAP_COLS;
+    unsigned char *staging;
+    unsigned int dirty = 0;
+
+    // Draw the background from the palette, so day turns to night by
+    // rewriting two entries
+    if (caps & VGA_BALL_CAP_PALETTE) {
+        vga_ball_frame_t frame;
+        set_palette(ART_INK, 2, day_colors);
+        frame.bg_index = ART_SKY;
+        frame.dirty = VGA_BALL_DIRTY_BG_INDEX;
+        set_frame(&frame);
+    }
+
+    if (!(caps & (VGA_BALL_CAP_TILEMAP | VGA_BALL_CAP_PATTERNS))) {
+        return 0;
+    }
+    staging = vgaball_staging(&vb);
+    if (staging == NULL) {
+        perror("could not map the staging buffer");
+        return 0;
+    }
+
+    // Each upload is done before the next one reuses the buffer
+    if (caps & VGA_BALL_CAP_TILEMAP) {
+        // The tiles follow the map, which is a multiple of 4 bytes long
+        world_ground(world, staging, staging + map_len);
+        if (vgaball_upload(&vb, VGA_BALL_REG_TILEMAP, 0, map_len) < 0 ||
+            vgaball_upload(&vb, VGA_BALL_REG_TILES, map_len,
+                           WORLD_BG_TILES * VGA_BALL_TILE_BYTES) < 0) {
+            perror("ground upload failed");
         } else {
-            // Animation complete
-            current_y = start_y;
-            break;
+            dirty |= VGA_BALL_DIRTY_SCROLL;
         }
-        
-        // Update ball position
-        pos->ycoor = current_y;
-        set_pos(pos);
-        
-        // Small delay to control animation framerate
-        usleep(10000); // ~100fps (1/100 second) for smoother animation
-        
-    } while (elapsed_time < animation_duration);
-    
-    // Ensure the ball is back at the starting position
-    pos->ycoor = start_y;
-    set_pos(pos);
+    }
+    if (caps & VGA_BALL_CAP_PATTERNS) {
+        art_patterns(staging);
+        if (vgaball_upload(&vb, VGA_BALL_REG_PATTERNS, 0,
+                           ART_NPATTERNS * VGA_BALL_TILE_BYTES) < 0) {
+            perror("pattern upload failed");
+        } else {
+            dirty |= VGA_BALL_DIRTY_BALL_FRAME;
+        }
+    }
+
+    return dirty;
+}
+
+#define PLAYER_RADIUS (VGA_BALL_TILE_SIZE * 3 / 8)  // hit box half-size, a little inside the ball
+
+/* Player state, advanced one tick at a time */
+struct player {
+    vga_ball_pos_t pos;
+    int base_y;          // where the ball returns to after jumps/ducks
+    enum move move;      // move in progress
+    int tick;            // ticks into the move
+    int release;         // jump: tick Up was let go, picks the jump table
+    int fall_from;       // fast-fall: height it started at
+    enum move queued;    // move to start when this one ends
+};
+
+/* Height above the base right now */
+int player_height(const struct player *p) {
+    switch (p->move) {
+    case MOVE_JUMP:
+        return jump_tables[p->release].height[p->tick];
+    case MOVE_FALL:
+        return p->fall_from - fall_table[p->tick];
+    case MOVE_DUCK:
+        return -duck_table[p->tick];
+    default:
+        return 0;
+    }
+}
+
+void player_start(struct player *p, enum move m) {
+    p->move = m;
+    p->tick = 0;
+    p->release = JUMP_HOLD_TICKS;  // until we hear otherwise, Up is held
+}
+
+/*
+ * Ask for a move.  Idle: it starts on the next tick.  The same move
+ * already running: it is queued to run again.  Down in the air starts a
+ * fast-fall; Up while ducking cancels the duck and jumps instead.
+ */
+void player_request(struct player *p, enum move m) {
+    if (m == MOVE_DUCK && p->move == MOVE_JUMP) {
+        p->fall_from = player_height(p);
+        player_start(p, MOVE_FALL);
+    } else if (p->move == m || (m == MOVE_JUMP && p->move == MOVE_FALL) ||
+               (m == MOVE_DUCK && p->move == MOVE_FALL)) {
+        p->queued = m;
+    } else {
+        player_start(p, m);
+        p->queued = MOVE_NONE;
+    }
+}
+
+/* Up was let go: the jump in progress stops rising as fast */
+void player_release(struct player *p) {
+    if (p->move == MOVE_JUMP && p->tick < p->release) {
+        p->release = p->tick;
+    }
+}
+
+/* Pattern to draw the player with; the run cycle steps with the ground */
+unsigned int player_pattern(const struct player *p, unsigned long distance) {
+    switch (p->move) {
+    case MOVE_JUMP:
+    case MOVE_FALL:
+        return ART_DINO_JUMP;
+    case MOVE_DUCK:
+        return ART_DINO_DUCK;
+    default:
+        return (distance / 24) & 1 ? ART_DINO_RUN1 : ART_DINO_RUN0;
+    }
+}
+
+/* Advance the player by one tick; returns 1 if the ball moved */
+int player_tick(struct player *p) {
+    int done = 0;
+
+    if (p->move != MOVE_NONE) {
+        p->tick++;
+    }
+    switch (p->move) {
+    case MOVE_JUMP:
+        done = p->tick >= jump_tables[p->release].len;
+        break;
+    case MOVE_FALL:
+        done = p->tick >= JUMP_MAX_TICKS || fall_table[p->tick] >= p->fall_from;
+        break;
+    case MOVE_DUCK:
+        done = p->tick >= MOVE_TICKS;
+        break;
+    default:
+        break;
+    }
+    if (done) {
+        // Move complete: start the queued one, if any
+        p->move = MOVE_NONE;
+        if (p->queued != MOVE_NONE) {
+            player_start(p, p->queued);
+            p->queued = MOVE_NONE;
+        }
+    }
+
+    int y = p->base_y - player_height(p);
+    if (y == p->pos.ycoor) {
+        return 0;
+    }
+    p->pos.ycoor = y;
+    return 1;
+}
+
+/*
+ * Act on a key event, live or played back, recording it if asked to.
+ * Returns 1 for quit.  Without releases (the terminal) Up counts as held for
+ * the whole jump, so it always runs at full height.
+ */
+int handle_key(struct player *player, const struct key_event *ev) {
+    if (recorder) {
+        replay_key(recorder, game_tick, ev);
+    }
+    if (ev->key == INPUT_QUIT) {
+        return 1;
+    } else if (ev->key == INPUT_UP) {
+        if (ev->pressed) {
+            player_request(player, MOVE_JUMP);
+        } else {
+            player_release(player);
+        }
+    } else if (ev->key == INPUT_DOWN && ev->pressed) {
+        player_request(player, MOVE_DUCK);
+    }
+    return 0;
 }
 
-int main() {
+/*
+ * Check the display is the one this program was built for: the same
+ * geometry and register layout.  A driver too old to say is taken to be.
+ * Returns 0 if it is.
+ */
+int check_config(void) {
+    const vga_ball_config_t want = VGA_BALL_CONFIG_INIT;
+    vga_ball_config_t have;
+
+    if (vgaball_config(&vb, &have) < 0) {
+        if (errno == ENOTTY) {
+            printf("The driver does not report its configuration, assuming %dx%d\n",
+                   VGA_BALL_WIDTH, VGA_BALL_HEIGHT);
+            return 0;
+        }
+        perror("could not read the display configuration");
+        return -1;
+    }
+    if (memcmp(&have, &want, sizeof(have)) != 0) {
+        fprintf(stderr, "The display is %ux%u (%u lines) at %u Hz, %u pixel tiles in a %ux%u map,"
+                " %#x byte window;\n", have.width, have.height, have.scanlines, have.refresh_hz,
+                have.tile_size, have.tilemap_cols, have.tilemap_rows, have.window);
+        fprintf(stderr, "this program is built for %ux%u (%u lines) at %u Hz, %u pixel tiles"
+                " in a %ux%u map, %#x byte window\n", want.width, want.height, want.scanlines,
+                want.refresh_hz, want.tile_size, want.tilemap_cols, want.tilemap_rows, want.window);
+        return -1;
+    }
+    return 0;
+}
+
+void usage(const char *prog) {
+    fprintf(stderr,
+            "usage: %s [-i tty|evdev|/dev/input/eventN] [-r] [-p priority] [-c cpu] [-d device]\n"
+            "          [-b backends] [-s seed] [-R file] [-P file] [-u]\n"
+            "  -i  where keys come from (default tty)\n"
+            "  -r  real-time mode: SCHED_FIFO, locked memory\n"
+            "  -p  SCHED_FIFO priority for -r (default %d)\n"
+            "  -c  pin to this CPU for -r\n"
+            "  -d  display to drive (default /dev/vga_ball)\n"
+            "  -b  backends to try, in order (default $" VGABALL_ENV ", else auto:\n"
+            "      " VGABALL_AUTO ")\n"
+            "  -s  obstacle seed (default the process id)\n"
+            "  -R  record keys and register updates to file\n"
+            "  -P  play the keys back from a recording instead of -i\n"
+            "  -u  unthrottled: a tick every time round the loop, not %d a second\n",
+            prog, RT_DEFAULT_PRIORITY, TICK_HZ);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]) {
     const char *device = "/dev/vga_ball";
-    struct termios orig_tio, raw_tio;
-    struct pollfd pfd;
-    char buf[8];
-    int ret;
+    const char *backends = NULL;
+    const char *input_spec = "tty";
+    const char *record_path = NULL, *play_path = NULL;
+    struct input input;
+    struct key_event ev[16];
+    struct pollfd pfd[2];
+    struct replay record, play;
+    struct replay_record played;
+    struct timespec start, end;
+    unsigned int seed = getpid();
+    int ret, opt, nfds, unthrottled = 0;
+    int realtime = 0, rt_priority = RT_DEFAULT_PRIORITY, rt_cpu = -1;
+
+    while ((opt = getopt(argc, argv, "i:rp:c:d:b:s:R:P:u")) != -1) {
+        switch (opt) {
+        case 'i': input_spec = optarg; break;
+        case 'r': realtime = 1; break;
+        case 'p': rt_priority = atoi(optarg); break;
+        case 'c': rt_cpu = atoi(optarg); break;
+        case 'd': device = optarg; break;
+        case 'b': backends = optarg; break;
+        case 's': seed = strtoul(optarg, NULL, 0); break;
+        case 'R': record_path = optarg; break;
+        case 'P': play_path = optarg; break;
+        case 'u': unthrottled = 1; break;
+        default: usage(argv[0]);
+        }
+    }
     
     // Ball starting coordinates (leftmost, 4 tiles from bottom)
-    // Assuming screen is 640x480 and tiles are 32x32
-    int x = 16; // Center of leftmost column
-    int y = 480 - (4 * 32) - 16; // 4 tiles up from bottom (center of tile)
-    
-    // Base position (where the ball returns to after jumps/ducks)
-    int base_y = y;
-    
-    // Flag to track if an animation is in progress
-    int animation_in_progress = 0;
+    int x = VGA_BALL_TILE_SIZE / 2; // Center of leftmost column
+    int y = VGA_BALL_HEIGHT - (4 * VGA_BALL_TILE_SIZE) - VGA_BALL_TILE_SIZE / 2; // 4 tiles up from bottom (center of tile)
+
+    struct player player;
+    struct pace pace;
+    struct world world;
+    vga_ball_sprites_t sprites;
+    unsigned int caps;
+    int night = 0;
 
     printf("VGA ball userspace program started (keyboard control mode)\n");
 
-    // Open the vga_ball device file
-    vga_ball_fd = open(device, O_RDWR);
-    if (vga_ball_fd == -1) {
-        perror("could not open /dev/vga_ball");
+    motion_init();
+
+    // A playback runs the recorded game: same seed, same tick rate
+    if (play_path) {
+        if (replay_open(&play, play_path) < 0) {
+            return EXIT_FAILURE;
+        }
+        if (play.hdr.hz != TICK_HZ) {
+            fprintf(stderr, "%s: recorded at %u ticks/s, not %d\n", play_path,
+                    play.hdr.hz, TICK_HZ);
+            return EXIT_FAILURE;
+        }
+        seed = play.hdr.seed;
+        printf("Playing back %s, seed %u\n", play_path, seed);
+    }
+    if (record_path) {
+        if (replay_create(&record, record_path, TICK_HZ, seed) < 0) {
+            return EXIT_FAILURE;
+        }
+        recorder = &record;
+    }
+
+    // Open the display through the first backend that works
+    if (vgaball_open(&vb, device, backends) < 0) {
+        fprintf(stderr, "could not open %s through %s: %s\n", device,
+                backends ? backends : "the default backends", strerror(errno));
+        return EXIT_FAILURE;
+    }
+    printf("Display %s through the %s backend\n", device, vgaball_backend_name(&vb));
+    if (check_config() < 0) {
+        vgaball_close(&vb);
         return EXIT_FAILURE;
     }
 
     // Set the VGA background to black (for contrast with the yellow ball)
+    // and initialize the ball's position in a single frame commit
     vga_ball_color_t black = {0x00, 0x00, 0x00};
-    set_background_color(&black);
+    memset(&player, 0, sizeof(player));
+    player.pos.xcoor = x;
+    player.pos.ycoor = y;
+    player.base_y = y;
 
-    // Initialize the ball's position
-    vga_ball_pos_t pos;
-    pos.xcoor = x;
-    pos.ycoor = y;
-    set_pos(&pos);
-
-    // Configure terminal for raw, non-blocking input
-    if (tcgetattr(STDIN_FILENO, &orig_tio) == -1) {
-        perror("tcgetattr");
-        close(vga_ball_fd);
-        return EXIT_FAILURE;
+    vga_ball_frame_t frame_update;
+    frame_update.position = player.pos;
+    frame_update.background = black;
+    frame_update.dirty = VGA_BALL_DIRTY_ALL;
+    set_frame(&frame_update);
+
+    // Only Y changes from here on, with the registers setup_video adds
+    frame_update.dirty = VGA_BALL_DIRTY_Y;
+
+    // Obstacles stand on the ground under the ball; without sprites they
+    // still collide, they just can't be seen
+    world_init(&world, y + VGA_BALL_TILE_SIZE / 2, seed);
+    caps = vb.caps;
+    if (!(caps & VGA_BALL_CAP_SPRITES)) {
+        printf("No sprites on this device, obstacles are invisible\n");
     }
-    raw_tio = orig_tio;
-    raw_tio.c_lflag &= ~(ICANON | ECHO);
-    raw_tio.c_cc[VMIN]  = 0;
-    raw_tio.c_cc[VTIME] = 0;
-    if (tcsetattr(STDIN_FILENO, TCSANOW, &raw_tio) == -1) {
-        perror("tcsetattr");
-        close(vga_ball_fd);
-        return EXIT_FAILURE;
+
+    // The ground scrolls by moving the tilemap and the dino runs by
+    // switching patterns, one register each per frame
+    frame_update.ball_frame = ART_BLANK;
+    frame_update.dirty |= setup_video(&world, caps);
+
+    // Real-time mode, once everything the loop needs has been set up
+    if (realtime) {
+        if (rt_setup(rt_priority, rt_cpu) < 0) {
+            vgaball_close(&vb);
+            return EXIT_FAILURE;
+        }
+        printf("Real-time mode: SCHED_FIFO priority %d%s\n", rt_priority,
+               rt_cpu >= 0 ? ", pinned" : "");
     }
 
-    printf("Use Up arrow to jump, Down arrow to duck. Press 'q' to quit.\n");
+    // Played-back keys replace the live ones
+    if (play_path) {
+        nfds = 0;
+    } else {
+        if (input_open(&input, input_spec) < 0) {
+            vgaball_close(&vb);
+            return EXIT_FAILURE;
+        }
+        nfds = 1;
+        printf("Use Up arrow to jump, Down arrow to duck. Press 'q' to quit.\n");
+    }
 
-    // Set up polling on standard input for key presses
-    pfd.fd = STDIN_FILENO;
-    pfd.events = POLLIN;
+    // Ticks come from the device's vblanks; without them, from the clock
+    if (unthrottled) {
+        pace_init(&pace, -1, 0);
+        printf("Unthrottled: running as fast as the game logic goes\n");
+    } else if (!pace_init(&pace, vgaball_fd(&vb), TICK_HZ)) {
+        printf("No vsync from the device, pacing from the clock\n");
+    }
 
-    // Main loop: wait for and handle key presses
+    // Poll the keyboard for key events; pfd[nfds] is left to the pacer
+    if (nfds) {
+        pfd[0].fd = input.fd;
+        pfd[0].events = POLLIN;
+    }
+
+    // Main loop: handle key presses as they arrive and advance the game
+    // one step per tick
+    clock_gettime(CLOCK_MONOTONIC, &start);
     while (1) {
-        // Wait for an input event (key press) with a short timeout to allow animations
-        ret = poll(&pfd, 1, 10); // 10ms timeout for responsive animations
+        ret = pace_wait(&pace, pfd, nfds);
         
         if (ret < 0) {
-            perror("poll failed");
+            perror("pace_wait failed");
             break;
         }
         
-        if (pfd.revents & POLLIN) {
-            // Read available input
-            int n = read(STDIN_FILENO, buf, sizeof(buf));
+        if (nfds && (pfd[0].revents & POLLIN)) {
+            int n = input_read(&input, ev, sizeof(ev) / sizeof(ev[0]));
             if (n < 0) {
-                if (errno == EAGAIN) continue;
                 perror("read failed");
                 break;
             }
-            
-            // Process input only if no animation is currently running
-            if (!animation_in_progress) {
-                // Process each byte/sequence in the input buffer
-                for (int i = 0; i < n; ++i) {
-                    unsigned char c = buf[i];
-                    if (c == 0x1B) {
-                        // Potential start of an escape sequence (arrow key)
-                        if (i <= n - 3 && buf[i] == 0x1B && buf[i+1] == 0x5B) {
-                            // We have ESC [ <code>
-                            unsigned char code = buf[i+2];
-                            if (code == 0x41) {  // 'A' = Up arrow - Jump
-                                animation_in_progress = 1;
-                                
-                                // Jump up 1.5 tiles (48 pixels)
-                                animate_movement(&pos, base_y, base_y - 48);
-                                
-                                animation_in_progress = 0;
-                            } else if (code == 0x42) {  // 'B' = Down arrow - Duck
-                                animation_in_progress = 1;
-                                
-                                // Duck down 1.5 tiles (48 pixels)
-                                animate_movement(&pos, base_y, base_y + 48);
-                                
-                                animation_in_progress = 0;
-                            }
-                            // Skip the two extra bytes of the escape sequence
-                            i += 2;
-                        }
-                    } else if (c == 'q' || c == 'Q') {
-                        // Quit command received
-                        printf("Quit command received. Exiting...\n");
-                        goto EXIT_LOOP;
-                    }
+            for (int i = 0; i < n; ++i) {
+                if (handle_key(&player, &ev[i])) {
+                    printf("Quit command received. Exiting...\n");
+                    goto EXIT_LOOP;
                 }
             }
         }
+
+        // Catch up on any ticks that were dropped, within reason
+        int ticks = ret;
+        if (ticks > MOVE_TICKS) {
+            ticks = MOVE_TICKS;
+        }
+
+        int moved = 0, scrolled = ticks > 0;
+        while (ticks-- > 0) {
+            // Played-back keys act just before the tick they were seen at
+            while (play_path && (ret = replay_next(&play, game_tick, &played)) != 0) {
+                if (ret < 0) {
+                    printf("End of the recording. Exiting...\n");
+                    goto EXIT_LOOP;
+                }
+                if (played.type != REPLAY_KEY) {
+                    continue;
+                }
+                ev[0].key = played.arg;
+                ev[0].pressed = played.value;
+                if (handle_key(&player, &ev[0])) {
+                    printf("Recorded quit. Exiting...\n");
+                    goto EXIT_LOOP;
+                }
+            }
+            moved |= player_tick(&player);
+            world_tick(&world);
+            if (world_collides(&world, player.pos.xcoor - PLAYER_RADIUS,
+                               player.pos.ycoor - PLAYER_RADIUS,
+                               2 * PLAYER_RADIUS, 2 * PLAYER_RADIUS)) {
+                printf("Game over, score %lu. Starting again\n",
+                       world.distance / WORLD_TILE);
+                world_init(&world, world.ground, world.rng);
+            }
+            game_tick++;
+        }
+        int changed = moved;
+        if (frame_update.dirty & VGA_BALL_DIRTY_SCROLL) {
+            changed |= scrolled;
+        }
+        if (frame_update.dirty & VGA_BALL_DIRTY_BALL_FRAME) {
+            unsigned int pattern = player_pattern(&player, world.distance);
+            changed |= pattern != frame_update.ball_frame;
+            frame_update.ball_frame = pattern;
+        }
+        if (changed) {
+            frame_update.position = player.pos;
+            frame_update.scroll_x = world_scroll_x(&world);
+            set_frame(&frame_update);
+        }
+        if (caps & VGA_BALL_CAP_PALETTE) {
+            int is_night = (world.distance / DAY_NIGHT_PX) & 1;
+            if (is_night != night) {
+                set_palette(ART_INK, 2, is_night ? night_colors : day_colors);
+                night = is_night;
+            }
+        }
+        if (scrolled && (caps & VGA_BALL_CAP_SPRITES)) {
+            world_sprites(&world, &sprites);
+            set_sprites(&sprites);
+        }
+        if (scrolled && vgaball_present(&vb) < 0) {
+            perror("could not present the frame");
+            break;
+        }
     }
 
 EXIT_LOOP:
-    // Restore original terminal settings before exiting
-    if (tcsetattr(STDIN_FILENO, TCSANOW, &orig_tio) == -1) {
-        perror("tcsetattr restore");
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    // Restores the original terminal settings, for the terminal
+    if (play_path) {
+        replay_close(&play);
+    } else {
+        input_close(&input);
+    }
+    if (recorder) {
+        replay_close(recorder);
+    }
+    vgaball_close(&vb);
+    printf("%lu ticks, %lu dropped, %lu game ticks, distance %lu\n",
+           pace.ticks, pace.dropped, game_tick, world.distance);
+    double secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    if (secs > 0) {
+        printf("%.3f s, %.0f game ticks/s\n", secs, game_tick / secs);
     }
-    close(vga_ball_fd);
     printf("VGA ball userspace program terminating\n");
     return 0;
 }
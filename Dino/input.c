@@ -0,0 +1,198 @@
+/*
+ * Terminal and evdev keyboard input
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <termios.h>
+#include <sys/ioctl.h>
+#include <linux/input.h>
+#include "input.h"
+
+#define INPUT_MAX_EVDEV 32   // /dev/input/event0 .. event31 are scanned
+
+#define BIT_WORD(b)  ((b) / (8 * sizeof(unsigned long)))
+#define BIT_MASK(b)  (1UL << ((b) % (8 * sizeof(unsigned long))))
+
+/* Does the evdev device on fd have the arrow keys we need? */
+static int evdev_has_arrows(int fd) {
+    unsigned long keys[BIT_WORD(KEY_MAX) + 1];
+
+    memset(keys, 0, sizeof(keys));
+    if (ioctl(fd, EVIOCGBIT(EV_KEY, sizeof(keys)), keys) < 0) {
+        return 0;
+    }
+    return (keys[BIT_WORD(KEY_UP)] & BIT_MASK(KEY_UP)) &&
+           (keys[BIT_WORD(KEY_DOWN)] & BIT_MASK(KEY_DOWN));
+}
+
+static int evdev_open(struct input *in, const char *path) {
+    in->fd = open(path, O_RDONLY | O_NONBLOCK);
+    if (in->fd == -1) {
+        return -1;
+    }
+    if (!evdev_has_arrows(in->fd)) {
+        close(in->fd);
+        in->fd = -1;
+        errno = ENODEV;
+        return -1;
+    }
+    // Take the keyboard for ourselves, so keys don't also reach the console
+    ioctl(in->fd, EVIOCGRAB, 1);
+    in->evdev = 1;
+    return 0;
+}
+
+static int evdev_scan(struct input *in) {
+    char path[32];
+
+    for (int i = 0; i < INPUT_MAX_EVDEV; i++) {
+        snprintf(path, sizeof(path), "/dev/input/event%d", i);
+        if (evdev_open(in, path) == 0) {
+            printf("Reading keys from %s\n", path);
+            return 0;
+        }
+    }
+    errno = ENODEV;
+    return -1;
+}
+
+static int tty_open(struct input *in) {
+    struct termios raw_tio;
+
+    // Raw, non-blocking input
+    in->fd = STDIN_FILENO;
+    if (tcgetattr(in->fd, &in->orig_tio) == -1) {
+        perror("tcgetattr");
+        return -1;
+    }
+    raw_tio = in->orig_tio;
+    raw_tio.c_lflag &= ~(ICANON | ECHO);
+    raw_tio.c_cc[VMIN]  = 0;
+    raw_tio.c_cc[VTIME] = 0;
+    if (tcsetattr(in->fd, TCSANOW, &raw_tio) == -1) {
+        perror("tcsetattr");
+        return -1;
+    }
+    return 0;
+}
+
+int input_open(struct input *in, const char *spec) {
+    memset(in, 0, sizeof(*in));
+    in->fd = -1;
+
+    if (!strcmp(spec, "tty")) {
+        return tty_open(in);
+    }
+    if (!strcmp(spec, "evdev")) {
+        if (evdev_scan(in) < 0) {
+            perror("no keyboard with arrow keys in /dev/input");
+            return -1;
+        }
+        return 0;
+    }
+    if (evdev_open(in, spec) < 0) {
+        perror(spec);
+        return -1;
+    }
+    return 0;
+}
+
+void input_close(struct input *in) {
+    if (in->evdev) {
+        close(in->fd);
+    } else if (tcsetattr(in->fd, TCSANOW, &in->orig_tio) == -1) {
+        perror("tcsetattr restore");
+    }
+    in->fd = -1;
+}
+
+static int evdev_key(int code, enum input_key *key) {
+    switch (code) {
+    case KEY_UP:   *key = INPUT_UP; return 1;
+    case KEY_DOWN: *key = INPUT_DOWN; return 1;
+    case KEY_Q:
+    case KEY_ESC:  *key = INPUT_QUIT; return 1;
+    default:       return 0;
+    }
+}
+
+static int evdev_read(struct input *in, struct key_event *ev, int max) {
+    struct input_event raw[16];
+    enum input_key key;
+    int n = 0;
+
+    // Never read more than we can report, so no release gets lost
+    if (max > (int)(sizeof(raw) / sizeof(raw[0]))) {
+        max = sizeof(raw) / sizeof(raw[0]);
+    }
+    ssize_t len = read(in->fd, raw, max * sizeof(raw[0]));
+    if (len < 0) {
+        return errno == EAGAIN ? 0 : -1;
+    }
+    for (int i = 0; i < len / (ssize_t)sizeof(raw[0]); i++) {
+        // value is 0 for a release, 1 for a press and 2 for a repeat
+        if (raw[i].type != EV_KEY || raw[i].value == 2 ||
+            !evdev_key(raw[i].code, &key) || in->held[key] == raw[i].value) {
+            continue;
+        }
+        in->held[key] = raw[i].value;
+        ev[n].key = key;
+        ev[n].pressed = raw[i].value;
+        n++;
+    }
+    return n;
+}
+
+/*
+ * Parse keys out of the terminal's bytes.  An escape sequence split across
+ * reads is kept in buf until the rest of it arrives.
+ */
+static int tty_read(struct input *in, struct key_event *ev, int max) {
+    int n = 0, i = 0;
+
+    ssize_t len = read(in->fd, in->buf + in->len, sizeof(in->buf) - in->len);
+    if (len < 0) {
+        return errno == EAGAIN ? 0 : -1;
+    }
+    in->len += len;
+
+    while (i < in->len && n < max) {
+        unsigned char c = in->buf[i];
+        if (c == 0x1B) {
+            // ESC [ <code>, or ESC O <code> in application cursor mode
+            if (i + 1 < in->len && in->buf[i+1] != '[' && in->buf[i+1] != 'O') {
+                i++;           // a lone ESC, not an arrow key
+                continue;
+            }
+            if (i + 3 > in->len) {
+                break;         // wait for the rest of the sequence
+            }
+            if (in->buf[i+2] == 'A') {         // Up arrow
+                ev[n].key = INPUT_UP;
+                ev[n++].pressed = 1;
+            } else if (in->buf[i+2] == 'B') {  // Down arrow
+                ev[n].key = INPUT_DOWN;
+                ev[n++].pressed = 1;
+            }
+            i += 3;
+        } else {
+            if (c == 'q' || c == 'Q') {
+                ev[n].key = INPUT_QUIT;
+                ev[n++].pressed = 1;
+            }
+            i++;
+        }
+    }
+
+    in->len -= i;
+    memmove(in->buf, in->buf + i, in->len);
+    return n;
+}
+
+int input_read(struct input *in, struct key_event *ev, int max) {
+    return in->evdev ? evdev_read(in, ev, max) : tty_read(in, ev, max);
+}
@@ -0,0 +1,47 @@
+/*
+ * Keyboard input for the game loop, from the terminal or from an evdev
+ * device (/dev/input/event*, which is also where USB HID keyboards show
+ * up).  The terminal only reports presses, and only as the escape
+ * sequences it sends for them; evdev reports presses and releases
+ * straight from the keyboard driver, so it can tell how long a key is
+ * held.
+ */
+
+/* not _INPUT_H, which <linux/input.h> uses */
+#ifndef _DINO_INPUT_H
+#define _DINO_INPUT_H
+
+#include <termios.h>
+
+enum input_key { INPUT_UP, INPUT_DOWN, INPUT_QUIT, INPUT_NKEYS };
+
+struct key_event {
+    enum input_key key;
+    int pressed;             // 1 for a press, 0 for a release
+};
+
+struct input {
+    int fd;                  // descriptor to poll for input
+    int evdev;               // 1: evdev device, 0: terminal
+    struct termios orig_tio; // terminal settings to restore, terminal only
+    unsigned char buf[16];   // bytes not yet parsed, terminal only
+    int len;
+    unsigned char held[INPUT_NKEYS];  // keys down right now, evdev only
+};
+
+/*
+ * Open an input backend: "tty" for standard input, "evdev" for the first
+ * /dev/input/event* device with arrow keys, or the path of a particular
+ * event device.  Returns 0, or -1 after printing what failed.
+ */
+int input_open(struct input *in, const char *spec);
+void input_close(struct input *in);
+
+/*
+ * Read whatever input is ready, without blocking, as up to max events.
+ * Key repeats while a key is held are not reported.  Returns the number
+ * of events, or -1 with errno set.
+ */
+int input_read(struct input *in, struct key_event *ev, int max);
+
+#endif
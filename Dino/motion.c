@@ -0,0 +1,77 @@
+/*
+ * Fixed-point motion tables
+ *
+ * The duck goes down and back up in a straight line each way.  Its progress
+ * fraction is rounded up so that a product which is a whole number of
+ * pixels comes out exact, matching what the old per-step double
+ * computation produced at every tick.
+ *
+ * Jumps and fast-falls are integrated once per tick in Q16.16, so every
+ * later lookup lands on exactly the pixels the simulation produced.
+ */
+
+#include "motion.h"
+
+/*
+ * The jump is tuned for a 48 pixel MOVE_DIST; other heights scale its
+ * speed and gravity, which keeps its timing.  All of it folds to constants.
+ */
+#define JUMP_SCALE(q) ((q16_t)((long long)(q) * MOVE_DIST / 48))
+
+#define JUMP_SPEED    JUMP_SCALE(Q16(4))      // initial upward speed, pixels per tick
+#define GRAVITY       JUMP_SCALE(Q16(0.35))   // pixels per tick per tick
+#define GRAVITY_HELD  JUMP_SCALE(Q16(0.135))  // while Up is held
+#define GRAVITY_FAST  JUMP_SCALE(Q16(1.2))    // fast-fall after Down
+
+struct jump_table jump_tables[JUMP_HOLD_TICKS + 1];
+unsigned short fall_table[JUMP_MAX_TICKS];
+short duck_table[MOVE_TICKS];
+
+/* Offset tick ticks into a move towards target and back */
+static int ramp(int target, int tick) {
+    q16_t half = Q16(MOVE_TICKS) / 2;
+    q16_t t = Q16(tick);
+
+    if (t < half) {
+        // First half of the move - going out to the target
+        return q16_trunc(target * q16_div_up(t, half));
+    } else {
+        // Second half of the move - coming back to the base
+        return target + q16_trunc(-target * q16_div_up(t - half, half));
+    }
+}
+
+/* Simulate a jump with Up released after release ticks */
+static void build_jump(struct jump_table *table, int release) {
+    q16_t speed = JUMP_SPEED, height = 0;
+    int tick;
+
+    table->height[0] = 0;
+    for (tick = 1; tick < JUMP_MAX_TICKS; tick++) {
+        height += speed;
+        speed -= (tick <= release) ? GRAVITY_HELD : GRAVITY;
+        if (height <= 0) {
+            break;
+        }
+        table->height[tick] = q16_trunc(height);
+    }
+    table->len = tick;
+}
+
+void motion_init(void) {
+    q16_t speed = 0, dist = 0;
+
+    for (int tick = 0; tick < MOVE_TICKS; tick++) {
+        duck_table[tick] = ramp(MOVE_DIST, tick);
+    }
+
+    for (int release = 0; release <= JUMP_HOLD_TICKS; release++) {
+        build_jump(&jump_tables[release], release);
+    }
+
+    for (int tick = 1; tick < JUMP_MAX_TICKS; tick++) {
+        speed += GRAVITY_FAST;
+        dist += speed;
+        fall_table[tick] = q16_trunc(dist) > 0xffff ? 0xffff : q16_trunc(dist);
+    }
+}
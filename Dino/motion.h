@@ -0,0 +1,62 @@
+/*
+ * Fixed-point (Q16.16) motion for the game loop: per-tick tables for the
+ * jump, fast-fall and duck moves, built once at startup so the hot loop
+ * does a table lookup instead of any physics or floating-point math.
+ */
+
+#ifndef _MOTION_H
+#define _MOTION_H
+
+#include "vga_ball.h"
+
+typedef int q16_t;
+
+#define Q16_ONE     (1 << 16)
+#define Q16(n)      ((q16_t)((n) * Q16_ONE))
+
+#define TICK_HZ     VGA_BALL_REFRESH_HZ  // game ticks per second (one per vblank)
+#define MOVE_TICKS  (TICK_HZ * 6 / 10)   // 0.6 second for a full duck
+#define MOVE_DIST   VGA_BALL_JUMP_HEIGHT // pixels, 1.5 tiles at 48
+
+/*
+ * Jumps are parabolic.  Gravity is weaker while Up is held, for at most
+ * JUMP_HOLD_TICKS: holding that long gives a MOVE_DIST, MOVE_TICKS jump,
+ * letting go at once gives about half the height.
+ */
+#define JUMP_HOLD_TICKS 12
+#define JUMP_MAX_TICKS  64               // longest a jump can stay in the air
+
+enum move { MOVE_NONE, MOVE_JUMP, MOVE_FALL, MOVE_DUCK };
+
+/* Height above the base, per tick, of a jump whose Up was released at a tick */
+struct jump_table {
+    int len;                             // ticks until landing
+    unsigned short height[JUMP_MAX_TICKS];
+};
+
+extern struct jump_table jump_tables[JUMP_HOLD_TICKS + 1];
+
+/* Distance dropped, per tick, after a fast-fall starts from rest */
+extern unsigned short fall_table[JUMP_MAX_TICKS];
+
+/* Duck offset below the base, per tick: down MOVE_DIST and back up */
+extern short duck_table[MOVE_TICKS];
+
+static inline q16_t q16_mul(q16_t a, q16_t b) {
+    return (q16_t)(((long long)a * b) >> 16);
+}
+
+/* a / b for a, b >= 0, rounded up */
+static inline q16_t q16_div_up(q16_t a, q16_t b) {
+    return (q16_t)((((long long)a << 16) + b - 1) / b);
+}
+
+/* Integer part, truncated toward zero like a cast from double */
+static inline int q16_trunc(q16_t a) {
+    return a >= 0 ? a >> 16 : -(-a >> 16);
+}
+
+/* Fill the tables; call once before the game loop */
+void motion_init(void);
+
+#endif
@@ -0,0 +1,117 @@
+/*
+ * Frame pacing against vblanks or absolute CLOCK_MONOTONIC deadlines
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include "vga_ball.h"
+#include "pace.h"
+
+#define NSEC_PER_SEC 1000000000LL
+
+static long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+static struct timespec to_timespec(long long ns) {
+    struct timespec ts;
+    ts.tv_sec = ns / NSEC_PER_SEC;
+    ts.tv_nsec = ns % NSEC_PER_SEC;
+    return ts;
+}
+
+int pace_init(struct pace *p, int fd, int hz) {
+    p->period = hz > 0 ? NSEC_PER_SEC / hz : 0;
+    p->ticks = 0;
+    p->dropped = 0;
+    if (hz > 0 && fd >= 0 && ioctl(fd, VGA_BALL_WAIT_VSYNC, &p->frame) == 0) {
+        p->fd = fd;
+        return 1;
+    }
+    p->fd = -1;
+    p->deadline = now_ns() + p->period;
+    return 0;
+}
+
+/* Count n ticks as delivered, all but one of them as dropped */
+static int pace_count(struct pace *p, unsigned int n) {
+    if (n > 1) {
+        p->dropped += n - 1;
+    }
+    p->ticks += n;
+    return n;
+}
+
+/* Ticks from the vblank count, if the device has a new one */
+static int pace_vsync(struct pace *p) {
+    unsigned int frame;
+
+    if (read(p->fd, &frame, sizeof(frame)) != sizeof(frame)) {
+        return errno == EINTR ? 0 : -1;
+    }
+    unsigned int n = frame - p->frame;
+    p->frame = frame;
+    return pace_count(p, n);
+}
+
+/* Ticks whose deadlines have passed; the next deadline stays on the grid */
+static int pace_clock(struct pace *p) {
+    long long now = now_ns();
+
+    if (now < p->deadline) {
+        return 0;
+    }
+    long long n = (now - p->deadline) / p->period + 1;
+    p->deadline += n * p->period;
+    return pace_count(p, n);
+}
+
+int pace_wait(struct pace *p, struct pollfd *pfd, int nfds) {
+    struct timespec ts;
+    int ret;
+
+    if (p->period == 0) {
+        // Unpaced: look at the caller's descriptors without waiting
+        if (nfds > 0 && poll(pfd, nfds, 0) < 0) {
+            return errno == EINTR ? 0 : -1;
+        }
+        return pace_count(p, 1);
+    }
+    if (p->fd < 0 && nfds == 0) {
+        // Nothing else to watch: sleep to the deadline itself
+        ts = to_timespec(p->deadline);
+        ret = clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+        if (ret != 0 && ret != EINTR) {
+            errno = ret;
+            return -1;
+        }
+        return pace_clock(p);
+    }
+
+    pfd[nfds].fd = p->fd;
+    pfd[nfds].events = POLLIN;
+    pfd[nfds].revents = 0;
+    if (p->fd >= 0) {
+        ret = ppoll(pfd, nfds + 1, NULL, NULL);
+    } else {
+        // ppoll only takes a relative timeout, but it is measured from
+        // the absolute deadline, so lateness doesn't accumulate
+        long long left = p->deadline - now_ns();
+        ts = to_timespec(left > 0 ? left : 0);
+        ret = ppoll(pfd, nfds + 1, &ts, NULL);
+    }
+    if (ret < 0) {
+        return errno == EINTR ? 0 : -1;
+    }
+
+    if (p->fd >= 0) {
+        return pfd[nfds].revents & POLLIN ? pace_vsync(p) : 0;
+    }
+    return pace_clock(p);
+}
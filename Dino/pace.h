@@ -0,0 +1,38 @@
+/*
+ * Frame pacing for the game loop.  Ticks come from the device's vblanks
+ * when it has them, otherwise from absolute CLOCK_MONOTONIC deadlines, so
+ * the period never drifts with the time spent handling each frame.
+ */
+
+#ifndef _PACE_H
+#define _PACE_H
+
+#include <poll.h>
+
+struct pace {
+    int fd;                  // device to read vblank counts from, or -1
+    long long period;        // ns per tick, clock pacing only; 0 unpaced
+    long long deadline;      // next tick on CLOCK_MONOTONIC, clock pacing only
+    unsigned int frame;      // last vblank count read, vsync pacing only
+    unsigned long ticks;     // ticks delivered so far
+    unsigned long dropped;   // of those, ticks that passed without a wakeup
+};
+
+/*
+ * Start pacing at hz ticks per second.  If fd is an open /dev/vga_ball
+ * with a working VGA_BALL_WAIT_VSYNC, vblanks are used instead of the
+ * clock.  Returns 1 for vsync pacing, 0 for clock pacing.  With hz 0
+ * there is no pacing: every pace_wait() is a tick, straight away.
+ */
+int pace_init(struct pace *p, int fd, int hz);
+
+/*
+ * Wait for the next tick, or until one of the caller's nfds descriptors
+ * in pfd is ready.  pfd must have room for nfds + 1 entries: the last is
+ * used for the vblank fd.  With nfds == 0, pfd may be NULL.  Returns the
+ * number of ticks that have passed since the last call (0 if woken by
+ * the caller's descriptors alone), or -1 with errno set.
+ */
+int pace_wait(struct pace *p, struct pollfd *pfd, int nfds);
+
+#endif
@@ -0,0 +1,116 @@
+/*
+ * Recording and replaying game runs
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "replay.h"
+#include "vgaball.h"
+
+#define REPLAY_BUFFER 65536   // records are written out this many bytes at a time
+
+int replay_create(struct replay *r, const char *path, unsigned int hz, unsigned int seed) {
+    memset(r, 0, sizeof(*r));
+    r->f = fopen(path, "wb");
+    if (r->f == NULL) {
+        perror(path);
+        return -1;
+    }
+    // Keep the game loop out of write() for all but one record in thousands
+    setvbuf(r->f, NULL, _IOFBF, REPLAY_BUFFER);
+
+    r->hdr.magic = REPLAY_MAGIC;
+    r->hdr.version = REPLAY_VERSION;
+    r->hdr.hz = hz;
+    r->hdr.seed = seed;
+    if (fwrite(&r->hdr, sizeof(r->hdr), 1, r->f) != 1) {
+        perror(path);
+        fclose(r->f);
+        r->f = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+int replay_open(struct replay *r, const char *path) {
+    memset(r, 0, sizeof(*r));
+    r->f = fopen(path, "rb");
+    if (r->f == NULL) {
+        perror(path);
+        return -1;
+    }
+    if (fread(&r->hdr, sizeof(r->hdr), 1, r->f) != 1 ||
+        r->hdr.magic != REPLAY_MAGIC || r->hdr.version != REPLAY_VERSION ||
+        r->hdr.hz == 0) {
+        fprintf(stderr, "%s: not a recording\n", path);
+        fclose(r->f);
+        r->f = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+void replay_close(struct replay *r) {
+    if (r->f == NULL) {
+        return;
+    }
+    // Write errors are sticky, so they all show up here
+    if (ferror(r->f) | fclose(r->f)) {
+        perror("writing the recording failed");
+    }
+    r->f = NULL;
+}
+
+static void replay_write(struct replay *r, unsigned long tick, enum replay_type type,
+                         unsigned int arg, unsigned int attr, unsigned int value) {
+    struct replay_record rec;
+
+    rec.tick = tick;
+    rec.type = type;
+    rec.arg = arg;
+    rec.attr = attr;
+    rec.value = value;
+    fwrite(&rec, sizeof(rec), 1, r->f);
+}
+
+void replay_key(struct replay *r, unsigned long tick, const struct key_event *ev) {
+    replay_write(r, tick, REPLAY_KEY, ev->key, 0, ev->pressed);
+}
+
+void replay_frame(struct replay *r, unsigned long tick, const vga_ball_frame_t *frame) {
+    for (unsigned int f = 0; f < VGA_BALL_NFIELDS; f++) {
+        if (frame->dirty & (1u << f)) {
+            replay_write(r, tick, REPLAY_UPDATE, f, 0, vgaball_get_field(frame, f));
+        }
+    }
+}
+
+void replay_sprites(struct replay *r, unsigned long tick, const vga_ball_sprites_t *sprites) {
+    for (unsigned int i = 0; i < sprites->count; i++) {
+        const vga_ball_sprite_t *sp = &sprites->sprites[i];
+        replay_write(r, tick, REPLAY_SPRITES, sprites->first + i, sp->flags << 8 | sp->tile,
+                     VGA_BALL_PACK_XY(sp->xcoor, sp->ycoor));
+    }
+}
+
+void replay_palette(struct replay *r, unsigned long tick, unsigned int first, unsigned int count,
+                    const unsigned int *colors) {
+    for (unsigned int i = 0; i < count; i++) {
+        replay_write(r, tick, REPLAY_PALETTE, first + i, 0, colors[i]);
+    }
+}
+
+int replay_next(struct replay *r, unsigned long tick, struct replay_record *rec) {
+    if (!r->have_next) {
+        if (fread(&r->next, sizeof(r->next), 1, r->f) != 1) {
+            return -1;
+        }
+        r->have_next = 1;
+    }
+    if (r->next.tick > tick) {
+        return 0;
+    }
+    *rec = r->next;
+    r->have_next = 0;
+    return 1;
+}
@@ -0,0 +1,72 @@
+/*
+ * Recording and replaying game runs.  A recording is a header followed by
+ * fixed-size records in native byte order, each stamped with the game tick
+ * it happened on: the key events the game loop acted on, and every
+ * register field, sprite table entry and palette entry it sent to the
+ * device.  Replaying the keys with the recorded seed runs the same game
+ * again, tick for tick; replaying the updates (bench -P) puts the same
+ * load on the driver.
+ */
+
+#ifndef _REPLAY_H
+#define _REPLAY_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include "vga_ball.h"
+#include "input.h"
+
+#define REPLAY_MAGIC   0x50524256   // "VBRP"
+#define REPLAY_VERSION 1
+
+struct replay_header {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t hz;             // game ticks per second
+    uint32_t seed;           // world_init seed
+};
+
+enum replay_type { REPLAY_KEY, REPLAY_UPDATE, REPLAY_SPRITES, REPLAY_PALETTE };
+
+struct replay_record {
+    uint32_t tick;           // game ticks run before this happened
+    uint8_t type;            // enum replay_type
+    uint8_t arg;             // key: enum input_key; update: VGA_BALL_FIELD_*;
+                             // sprites and palette: entry number
+    uint16_t attr;           // sprites: flags << 8 | tile; otherwise 0
+    uint32_t value;          // key: 1 pressed, 0 released; update: field value;
+                             // sprites: VGA_BALL_PACK_XY(x, y); palette: color
+};
+
+struct replay {
+    FILE *f;
+    struct replay_header hdr;
+    struct replay_record next;  // read ahead, playback only
+    int have_next;
+};
+
+/*
+ * Start a recording at path, or open one for playback and read its
+ * header into r->hdr.  Return 0, or -1 after printing what failed.
+ */
+int replay_create(struct replay *r, const char *path, unsigned int hz, unsigned int seed);
+int replay_open(struct replay *r, const char *path);
+void replay_close(struct replay *r);
+
+/*
+ * Record a key event, each field named in frame->dirty, or each sprite
+ * table or palette entry written
+ */
+void replay_key(struct replay *r, unsigned long tick, const struct key_event *ev);
+void replay_frame(struct replay *r, unsigned long tick, const vga_ball_frame_t *frame);
+void replay_sprites(struct replay *r, unsigned long tick, const vga_ball_sprites_t *sprites);
+void replay_palette(struct replay *r, unsigned long tick, unsigned int first, unsigned int count,
+                    const unsigned int *colors);
+
+/*
+ * Take the next record if it happened by tick.  Returns 1 with *rec
+ * filled in, 0 if the next record is later, or -1 at the end.
+ */
+int replay_next(struct replay *r, unsigned long tick, struct replay_record *rec);
+
+#endif
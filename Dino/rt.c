@@ -0,0 +1,55 @@
+/*
+ * Real-time setup for the game loop
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "rt.h"
+
+#define RT_STACK_PREFAULT (64 * 1024)  // stack the main loop may touch
+
+/*
+ * Touch the stack we will use so the loop never takes a page fault on it.
+ * The stores go through the volatile array, one per page, so the compiler
+ * can't drop them for never being read.
+ */
+static void __attribute__((noinline)) prefault_stack(void) {
+    volatile unsigned char stack[RT_STACK_PREFAULT];
+    size_t page = sysconf(_SC_PAGESIZE);
+
+    for (size_t i = 0; i < sizeof(stack); i += page) {
+        stack[i] = 0;
+    }
+}
+
+int rt_setup(int priority, int cpu) {
+    struct sched_param param;
+    cpu_set_t cpus;
+
+    if (mlockall(MCL_CURRENT | MCL_FUTURE) == -1) {
+        perror("mlockall");
+        return -1;
+    }
+    prefault_stack();
+
+    if (cpu >= 0) {
+        CPU_ZERO(&cpus);
+        CPU_SET(cpu, &cpus);
+        if (sched_setaffinity(0, sizeof(cpus), &cpus) == -1) {
+            perror("sched_setaffinity");
+            return -1;
+        }
+    }
+
+    memset(&param, 0, sizeof(param));
+    param.sched_priority = priority;
+    if (sched_setscheduler(0, SCHED_FIFO, &param) == -1) {
+        perror("sched_setscheduler(SCHED_FIFO)");
+        return -1;
+    }
+    return 0;
+}
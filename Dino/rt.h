@@ -0,0 +1,18 @@
+/*
+ * Real-time setup for the game loop: SCHED_FIFO, CPU pinning, locked and
+ * pre-faulted memory, so frame updates don't slip under load.
+ */
+
+#ifndef _RT_H
+#define _RT_H
+
+#define RT_DEFAULT_PRIORITY 50
+
+/*
+ * Switch the calling process to SCHED_FIFO at priority, pinned to cpu
+ * (or any CPU if cpu < 0), with all memory locked.  Call it right before
+ * the main loop.  Returns 0, or -1 after printing what failed.
+ */
+int rt_setup(int priority, int cpu);
+
+#endif
@@ -0,0 +1,239 @@
+/*
+ * Software model of the display core
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include "sim.h"
+
+#define REG(s, off) ((s)->regs[(off) / 4])
+#define MEM(s, off) ((const unsigned char *)(s)->regs + (off))
+
+/* Device memory an upload may write, as the driver allows it */
+static const struct {
+    unsigned int start, end;
+} upload_regions[] = {
+    { VGA_BALL_REG_TILEMAP, VGA_BALL_REG_TILEMAP_END },
+    { VGA_BALL_REG_TILES, VGA_BALL_REG_TILES_END },
+    { VGA_BALL_REG_PATTERNS, VGA_BALL_REG_PATTERNS_END },
+};
+
+void sim_init(struct sim *s) {
+    memset(s, 0, sizeof(*s));
+}
+
+int sim_frame(struct sim *s, const vga_ball_frame_t *frame) {
+    unsigned int dirty = frame->dirty;
+
+    if (dirty & ~VGA_BALL_DIRTY_FRAME) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (dirty & VGA_BALL_DIRTY_X) {
+        REG(s, VGA_BALL_REG_XCOOR) = frame->position.xcoor;
+    }
+    if (dirty & VGA_BALL_DIRTY_Y) {
+        REG(s, VGA_BALL_REG_YCOOR) = frame->position.ycoor;
+    }
+    if (dirty & VGA_BALL_DIRTY_RED) {
+        REG(s, VGA_BALL_REG_BG_RED) = frame->background.red;
+    }
+    if (dirty & VGA_BALL_DIRTY_GREEN) {
+        REG(s, VGA_BALL_REG_BG_GREEN) = frame->background.green;
+    }
+    if (dirty & VGA_BALL_DIRTY_BLUE) {
+        REG(s, VGA_BALL_REG_BG_BLUE) = frame->background.blue;
+    }
+    if (dirty & VGA_BALL_DIRTY_SCROLL) {
+        REG(s, VGA_BALL_REG_SCROLL_X) = frame->scroll_x;
+    }
+    if (dirty & VGA_BALL_DIRTY_BALL_FRAME) {
+        REG(s, VGA_BALL_REG_BALL_FRAME) = frame->ball_frame;
+        s->ball_pattern = 1;
+    }
+    if (dirty & VGA_BALL_DIRTY_BG_INDEX) {
+        REG(s, VGA_BALL_REG_BG_INDEX) = frame->bg_index;
+    }
+    return 0;
+}
+
+int sim_sprites(struct sim *s, const vga_ball_sprites_t *sprites) {
+    const vga_ball_sprite_t *sp;
+
+    if (sprites->first >= VGA_BALL_MAX_SPRITES ||
+        sprites->count > VGA_BALL_MAX_SPRITES - sprites->first) {
+        errno = EINVAL;
+        return -1;
+    }
+    for (unsigned int i = 0; i < sprites->count; i++) {
+        sp = &sprites->sprites[i];
+        REG(s, VGA_BALL_REG_SPRITE_POS(sprites->first + i)) = VGA_BALL_PACK_XY(sp->xcoor, sp->ycoor);
+        REG(s, VGA_BALL_REG_SPRITE_ATTR(sprites->first + i)) = sp->flags << 8 | sp->tile;
+    }
+    return 0;
+}
+
+int sim_palette(struct sim *s, const vga_ball_palette_t *pal) {
+    if (pal->first >= VGA_BALL_PALETTE_SIZE ||
+        pal->count > VGA_BALL_PALETTE_SIZE - pal->first) {
+        errno = EINVAL;
+        return -1;
+    }
+    for (unsigned int i = 0; i < pal->count; i++) {
+        REG(s, VGA_BALL_REG_PALETTE_ENTRY(pal->first + i)) = pal->colors[i] & 0xffffff;
+    }
+    return 0;
+}
+
+int sim_upload(struct sim *s, const vga_ball_upload_t *up, const void *staging) {
+    unsigned int i;
+
+    if (((up->offset | up->src | up->len) & 3) ||
+        up->src > VGA_BALL_STAGING_SIZE || up->len > VGA_BALL_STAGING_SIZE - up->src) {
+        errno = EINVAL;
+        return -1;
+    }
+    for (i = 0; i < sizeof(upload_regions) / sizeof(upload_regions[0]); i++) {
+        if (up->offset >= upload_regions[i].start && up->offset < upload_regions[i].end &&
+            up->len <= upload_regions[i].end - up->offset) {
+            break;
+        }
+    }
+    if (i == sizeof(upload_regions) / sizeof(upload_regions[0])) {
+        errno = EINVAL;
+        return -1;
+    }
+    memcpy((unsigned char *)s->regs + up->offset, (const unsigned char *)staging + up->src, up->len);
+    return 0;
+}
+
+static uint32_t palette(const struct sim *s, unsigned int index) {
+    return REG(s, VGA_BALL_REG_PALETTE_ENTRY(index & (VGA_BALL_PALETTE_SIZE - 1)));
+}
+
+/* Layer 1: the tilemap, wrapping around as it scrolls; index 0 shows through */
+static void render_tilemap(struct sim *s) {
+    const unsigned int width = VGA_BALL_TILEMAP_COLS * VGA_BALL_TILE_SIZE;
+    const unsigned char *map = MEM(s, VGA_BALL_REG_TILEMAP);
+    unsigned int scroll = REG(s, VGA_BALL_REG_SCROLL_X) % width;
+
+    for (unsigned int y = 0; y < SIM_HEIGHT; y++) {
+        const unsigned char *row = map + (y / VGA_BALL_TILE_SIZE) * VGA_BALL_TILEMAP_COLS;
+        for (unsigned int x = 0; x < SIM_WIDTH; x++) {
+            unsigned int mx = (x + scroll) % width;
+            unsigned int tile = row[mx / VGA_BALL_TILE_SIZE];
+            unsigned int c;
+
+            if (tile >= VGA_BALL_MAX_TILES) {
+                continue;
+            }
+            c = MEM(s, VGA_BALL_REG_TILES + tile * VGA_BALL_TILE_BYTES)
+                [(y % VGA_BALL_TILE_SIZE) * VGA_BALL_TILE_SIZE + mx % VGA_BALL_TILE_SIZE];
+            if (c) {
+                s->fb[y][x] = palette(s, c);
+            }
+        }
+    }
+}
+
+/* A 32x32 pattern with its top-left corner at x0, y0, clipped to the screen */
+static void render_pattern(struct sim *s, unsigned int pattern, int x0, int y0, unsigned int flags) {
+    const unsigned char *pixels;
+
+    if (pattern >= VGA_BALL_MAX_PATTERNS) {
+        return;
+    }
+    pixels = MEM(s, VGA_BALL_REG_PATTERNS + pattern * VGA_BALL_TILE_BYTES);
+    for (int py = 0; py < VGA_BALL_TILE_SIZE; py++) {
+        int y = y0 + py;
+        int sy = (flags & VGA_BALL_SPRITE_VFLIP) ? VGA_BALL_TILE_SIZE - 1 - py : py;
+
+        if (y < 0 || y >= SIM_HEIGHT) {
+            continue;
+        }
+        for (int px = 0; px < VGA_BALL_TILE_SIZE; px++) {
+            int x = x0 + px;
+            int sx = (flags & VGA_BALL_SPRITE_HFLIP) ? VGA_BALL_TILE_SIZE - 1 - px : px;
+            unsigned int c = pixels[sy * VGA_BALL_TILE_SIZE + sx];
+
+            if (x >= 0 && x < SIM_WIDTH && c) {
+                s->fb[y][x] = palette(s, c);
+            }
+        }
+    }
+}
+
+/* Layer 3: the ball, a pattern centered on it once one is picked */
+static void render_ball(struct sim *s) {
+    int bx = (int)REG(s, VGA_BALL_REG_XCOOR), by = (int)REG(s, VGA_BALL_REG_YCOOR);
+
+    if (s->ball_pattern) {
+        render_pattern(s, REG(s, VGA_BALL_REG_BALL_FRAME), bx - VGA_BALL_TILE_SIZE / 2,
+                       by - VGA_BALL_TILE_SIZE / 2, 0);
+        return;
+    }
+    for (int y = by - SIM_BALL_RADIUS; y <= by + SIM_BALL_RADIUS; y++) {
+        for (int x = bx - SIM_BALL_RADIUS; x <= bx + SIM_BALL_RADIUS; x++) {
+            int dx = x - bx, dy = y - by;
+            if (x >= 0 && x < SIM_WIDTH && y >= 0 && y < SIM_HEIGHT &&
+                dx * dx + dy * dy <= SIM_BALL_RADIUS * SIM_BALL_RADIUS) {
+                s->fb[y][x] = SIM_BALL_COLOR;
+            }
+        }
+    }
+}
+
+void sim_render(struct sim *s) {
+    unsigned int bg_index = REG(s, VGA_BALL_REG_BG_INDEX);
+    uint32_t bg;
+
+    // Layer 0: the background, from the palette if BG_INDEX picks an entry
+    if (bg_index) {
+        bg = palette(s, bg_index);
+    } else {
+        bg = VGA_BALL_PACK_RGB(REG(s, VGA_BALL_REG_BG_RED) & 0xff,
+                               REG(s, VGA_BALL_REG_BG_GREEN) & 0xff,
+                               REG(s, VGA_BALL_REG_BG_BLUE) & 0xff);
+    }
+    for (unsigned int y = 0; y < SIM_HEIGHT; y++) {
+        for (unsigned int x = 0; x < SIM_WIDTH; x++) {
+            s->fb[y][x] = bg;
+        }
+    }
+
+    render_tilemap(s);
+
+    // Layer 2: sprites, each over the ones before it
+    for (unsigned int i = 0; i < VGA_BALL_MAX_SPRITES; i++) {
+        uint32_t pos = REG(s, VGA_BALL_REG_SPRITE_POS(i));
+        uint32_t attr = REG(s, VGA_BALL_REG_SPRITE_ATTR(i));
+        unsigned int flags = attr >> 8;
+
+        if (flags & VGA_BALL_SPRITE_ENABLE) {
+            render_pattern(s, attr & 0xff, (int16_t)(pos & 0xffff), (int16_t)(pos >> 16), flags);
+        }
+    }
+
+    render_ball(s);
+
+    s->frames++;
+    REG(s, VGA_BALL_REG_FRAME_COUNT) = s->frames;
+}
+
+int sim_write_ppm(const struct sim *s, FILE *f) {
+    unsigned char row[SIM_WIDTH * 3];
+
+    fprintf(f, "P6\n%d %d\n255\n", SIM_WIDTH, SIM_HEIGHT);
+    for (unsigned int y = 0; y < SIM_HEIGHT; y++) {
+        for (unsigned int x = 0; x < SIM_WIDTH; x++) {
+            row[3 * x] = s->fb[y][x] >> 16;
+            row[3 * x + 1] = s->fb[y][x] >> 8;
+            row[3 * x + 2] = s->fb[y][x];
+        }
+        if (fwrite(row, sizeof(row), 1, f) != 1) {
+            return -1;
+        }
+    }
+    return fflush(f);
+}
@@ -0,0 +1,47 @@
+/*
+ * A software model of the display core: the register window as the
+ * hardware sees it, and a renderer from it to a framebuffer the size of
+ * the screen.  The sim backend of libvgaball sends its updates here, so
+ * the game runs, and can be watched, with no board at all.
+ */
+
+#ifndef _SIM_H
+#define _SIM_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include "vga_ball.h"
+
+#define SIM_WIDTH       VGA_BALL_WIDTH
+#define SIM_HEIGHT      VGA_BALL_HEIGHT
+#define SIM_BALL_RADIUS (VGA_BALL_TILE_SIZE / 2)  // without a pattern the ball is a circle this big
+#define SIM_BALL_COLOR  0xffff00  // and this color
+#define SIM_WINDOW      VGA_BALL_REG_PATTERNS_END  // register window bytes
+
+struct sim {
+    uint32_t regs[SIM_WINDOW / 4];            // register window
+    uint32_t fb[SIM_HEIGHT][SIM_WIDTH];       // VGA_BALL_PACK_RGB pixels
+    int ball_pattern;                          // BALL_FRAME written: draw it
+    unsigned long frames;                      // frames rendered
+};
+
+void sim_init(struct sim *s);
+
+/*
+ * Register writes, checked as the driver checks them: the fields named in
+ * frame->dirty, sprite table and palette entries, and a copy of up->len
+ * bytes at staging + up->src to device memory.  Return 0, or -1 with
+ * errno set.
+ */
+int sim_frame(struct sim *s, const vga_ball_frame_t *frame);
+int sim_sprites(struct sim *s, const vga_ball_sprites_t *sprites);
+int sim_palette(struct sim *s, const vga_ball_palette_t *pal);
+int sim_upload(struct sim *s, const vga_ball_upload_t *up, const void *staging);
+
+/* Scan out one frame from the registers into s->fb */
+void sim_render(struct sim *s);
+
+/* Write s->fb as a binary PPM; returns 0 or -1 with errno set */
+int sim_write_ppm(const struct sim *s, FILE *f);
+
+#endif
@@ -8,77 +8,977 @@
 #include <linux/slab.h>
 #include <linux/io.h>
 #include <linux/of.h>
-#include <linux/of_address.h>
 #include <linux/fs.h>
 #include <linux/uaccess.h>
+#include <linux/mm.h>
+#include <linux/interrupt.h>
+#include <linux/irq.h>
+#include <linux/hrtimer.h>
+#include <linux/wait.h>
+#include <linux/poll.h>
+#include <linux/vmalloc.h>
+#include <linux/seqlock.h>
+#include <linux/ktime.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/kfifo.h>
+#include <linux/mutex.h>
+#include <linux/idr.h>
+#include <linux/kref.h>
+#include <linux/rwsem.h>
+#include <linux/list.h>
+#include <linux/pm_runtime.h>
+#include <linux/clk.h>
 #include "vga_ball.h"
 
 #define DRIVER_NAME "vga_ball"
 
 /* Device register offsets */
-#define BALL_XCOOR(x)   ((x) + 0)   // X coordinate register offset
-#define BALL_YCOOR(x)   ((x) + 4)   // Y coordinate register offset
-#define BG_RED(x)       ((x) + 8)   // Background red component register
-#define BG_GREEN(x)     ((x) + 12)  // Background green component register
-#define BG_BLUE(x)      ((x) + 16)  // Background blue component register
+#define BALL_XCOOR(x)   ((x) + VGA_BALL_REG_XCOOR)     // X coordinate register offset
+#define BALL_YCOOR(x)   ((x) + VGA_BALL_REG_YCOOR)     // Y coordinate register offset
+#define BG_RED(x)       ((x) + VGA_BALL_REG_BG_RED)    // Background red component register
+#define BG_GREEN(x)     ((x) + VGA_BALL_REG_BG_GREEN)  // Background green component register
+#define BG_BLUE(x)      ((x) + VGA_BALL_REG_BG_BLUE)   // Background blue component register
+#define IRQ_ACK(x)      ((x) + VGA_BALL_REG_IRQ_ACK)   // Vblank interrupt acknowledge register
+#define POS_XY(x)       ((x) + VGA_BALL_REG_POS_XY)    // Packed position register
+#define BG_RGB(x)       ((x) + VGA_BALL_REG_BG_RGB)    // Packed background color register
+#define SCROLL_X(x)     ((x) + VGA_BALL_REG_SCROLL_X)  // Tilemap scroll offset register
+#define BALL_FRAME(x)   ((x) + VGA_BALL_REG_BALL_FRAME) // Ball sprite pattern register
+#define BG_INDEX(x)     ((x) + VGA_BALL_REG_BG_INDEX)  // Background palette index register
+#define PALETTE(x, i)   ((x) + VGA_BALL_REG_PALETTE_ENTRY(i))  // Palette entry
+#define FRAME_COUNT(x)  ((x) + VGA_BALL_REG_FRAME_COUNT) // Hardware frame counter
+#define SCANLINE(x)     ((x) + VGA_BALL_REG_SCANLINE)  // Current scanline
+#define SPRITE_POS(x, i)  ((x) + VGA_BALL_REG_SPRITE_POS(i))   // Sprite position word
+#define SPRITE_ATTR(x, i) ((x) + VGA_BALL_REG_SPRITE_ATTR(i))  // Sprite tile and flags word
 
-/* Device information structure */
+/* The layout the build configuration gives device memory has to fit */
+_Static_assert(VGA_BALL_REG_TILEMAP_END <= VGA_BALL_REG_TILES, "tilemap overlaps the tiles");
+_Static_assert(VGA_BALL_TILEMAP_COLS * VGA_BALL_TILE_SIZE >= VGA_BALL_WIDTH, "tilemap narrower than the screen");
+_Static_assert(VGA_BALL_TILEMAP_ROWS * VGA_BALL_TILE_SIZE == VGA_BALL_HEIGHT, "tilemap rows don't fill the screen");
+_Static_assert(VGA_BALL_SCANLINES > VGA_BALL_HEIGHT, "no vertical blanking");
+
+/* What this driver was built for, for VGA_BALL_READ_CONFIG */
+static const vga_ball_config_t vga_ball_config = VGA_BALL_CONFIG_INIT;
+
+/* Period of the software vblank used when the device tree gives no IRQ */
+#define VSYNC_PERIOD_NS (NSEC_PER_SEC / VGA_BALL_REFRESH_HZ)
+
+/* How long the device stays powered after the last close, in case of a reopen */
+#define AUTOSUSPEND_MS  2000
+
+/* Keyframe animation in progress */
+struct vga_ball_anim {
+    vga_ball_anim_t desc;  /* animation being run, count 0 if none */
+    unsigned int key;      /* index of the keyframe being approached */
+    unsigned int frame;    /* vblanks spent approaching it */
+    s32 from_x, from_y;    /* Q16.16 position the current segment started at */
+};
+
+/* Registers whose last written value is cached, to skip redundant writes */
+enum { HW_X, HW_Y, HW_RED, HW_GREEN, HW_BLUE, HW_XY, HW_RGB, HW_SCROLL, HW_BALL_FRAME, HW_BG_INDEX, HW_NREGS };
+
+/*
+ * What the hardware holds.  A value is only trusted while its valid bit is
+ * set; nothing is trusted while userspace has the registers mmap()ed, and
+ * everything is forgotten when a mapping is made, so one that comes and
+ * goes between two commits is not missed.
+ */
+struct vga_ball_hw {
+    u32 regs[HW_NREGS];
+    u32 valid;                 /* bit n: regs[n] is the hardware value */
+    u32 sprite_pos[VGA_BALL_MAX_SPRITES];
+    u32 sprite_attr[VGA_BALL_MAX_SPRITES];
+    u32 sprite_pos_valid, sprite_attr_valid;
+    bool trusted;              /* set by commit_shadow when nothing is mapped */
+};
+
+#ifdef CONFIG_DEBUG_FS
+/*
+ * Hot-path instrumentation under debugfs: per-ioctl call counts and
+ * latency, time spent copying to and from userspace, and the vblank commit
+ * that does the MMIO writes.  Latency histogram bucket n counts calls that
+ * took under 2^(n + 8) ns; the last bucket takes everything slower.
+ */
+#define DEBUG_NR_CMDS   16
+#define DEBUG_BUCKETS   20
+
+struct vga_ball_latency {
+    u64 calls, errors;
+    u64 total_ns, max_ns;
+    u64 copy_ns;
+    u64 hist[DEBUG_BUCKETS];
+};
+
+struct vga_ball_debug {
+    struct dentry *dir;
+    spinlock_t lock;                /* taken from the vblank handler too */
+    struct vga_ball_latency cmds[DEBUG_NR_CMDS];  /* by _IOC_NR */
+    struct vga_ball_latency commit; /* commit_shadow at vblank */
+};
+#endif
+
+/*
+ * Device information structure, one per display controller.  It outlives
+ * an unbind while files are still open: the bound driver and each open
+ * file hold a reference, and the last one frees it.
+ */
 struct vga_ball_dev {
+    struct miscdevice misc;  /* our /dev node; file->private_data on open */
+    char name[16];           /* misc device name: vga_ball, vga_ball1, ... */
+    int id;                  /* from vga_ball_ida */
+    struct device *device;   /* the platform device, for runtime PM */
     struct resource res;     /* resource for our registers */
     void __iomem *virtbase;  /* virtual base address for registers */
+    struct clk *clk;         /* bridge clock, gated while suspended; may be NULL */
+    struct kref ref;
+    /*
+     * File operations that use the hardware hold remove_lock for reading;
+     * remove sets dead, then takes it for writing to wait them out.
+     * Afterwards they all fail with -ENODEV.
+     */
+    struct rw_semaphore remove_lock;
+    bool dead;
+    struct mutex files_lock;
+    struct list_head files;  /* open vga_ball_files, protected by files_lock */
+    /*
+     * Shadow registers: userspace writes land here and the vblank handler
+     * commits the fields named in dirty, so a frame is never half-applied.
+     */
     vga_ball_color_t background;
     vga_ball_pos_t   position;
-} dev;
+    u32 scroll_x;
+    u32 ball_frame;
+    u32 bg_index;
+    unsigned int dirty;            /* VGA_BALL_DIRTY_* fields not yet committed */
+    vga_ball_sprite_t sprites[VGA_BALL_MAX_SPRITES];
+    u32 sprite_dirty;              /* bit i: sprites[i] not yet committed */
+    u32 palette[VGA_BALL_PALETTE_SIZE];
+    DECLARE_BITMAP(palette_dirty, VGA_BALL_PALETTE_SIZE);
+    unsigned int caps;             /* VGA_BALL_CAP_* */
+    /*
+     * Serializes commits of the shadow registers and everything else marked
+     * "protected by lock".  Readers of the shadow registers don't take it,
+     * they retry instead, so telemetry never holds up the writer.
+     */
+    seqlock_t lock;
+    unsigned int irq;              /* vblank interrupt, 0 if none */
+    struct hrtimer vsync_timer;    /* software vblank when there is no IRQ */
+    wait_queue_head_t vsync_wait;  /* readers waiting for the next vblank */
+    u32 frame_count;               /* vblanks since probe */
+    u64 vblank_ns;                 /* when the last vblank was handled, protected by lock */
+    u32 vblank_hw_frame;           /* FRAME_COUNT at the last vblank, protected by lock */
+    vga_ball_ring_t *ring;         /* command ring shared with userspace */
+    struct vga_ball_file *ring_owner; /* the one file allowed to map the ring */
+    u32 ring_tail;                 /* our copy of ring->tail, which userspace can scribble on */
+    void *staging;                 /* VGA_BALL_UPLOAD source, mapped by userspace */
+    struct vga_ball_file *staging_owner; /* the one file allowed to map and upload it */
+    /*
+     * Records from write(), drained at vblank.  The vblank is the only
+     * consumer and write_lock makes writers take turns as the producer,
+     * so the FIFO itself needs no lock.
+     */
+    DECLARE_KFIFO(updates, vga_ball_update_t, VGA_BALL_UPDATE_QUEUE);
+    struct mutex write_lock;
+    struct vga_ball_anim anim;     /* protected by lock */
+    struct vga_ball_hw hw;         /* protected by lock */
+    atomic_t regs_mapped;          /* user mappings of the register window */
+    vga_ball_stats_t stats;        /* protected by lock */
+#ifdef CONFIG_DEBUG_FS
+    struct vga_ball_debug debug;
+#endif
+};
+
+/* Instance numbers, for naming the misc devices */
+static DEFINE_IDA(vga_ball_ida);
 
-/* Write the background color to hardware and store it */
-static void write_background(vga_ball_color_t *background) {
-    iowrite32(background->red,   BG_RED(dev.virtbase));
-    iowrite32(background->green, BG_GREEN(dev.virtbase));
-    iowrite32(background->blue,  BG_BLUE(dev.virtbase));
-    dev.background = *background;
+/* Per-open state, in file->private_data */
+struct vga_ball_file {
+    struct vga_ball_dev *dev;  /* the instance this file was opened on */
+    u32 last_frame;  /* last frame count returned to this file */
+    struct address_space *mapping;  /* its mmap()s, zapped on remove */
+    struct list_head node;     /* in dev->files */
+};
+
+static void vga_ball_free(struct kref *ref) {
+    struct vga_ball_dev *dev = container_of(ref, struct vga_ball_dev, ref);
+
+    vfree(dev->staging);
+    vfree(dev->ring);
+    put_device(dev->device);
+    kfree(dev);
 }
 
-/* Write the ball position to hardware (does not update dev.position here) */
-static void write_pos(vga_ball_pos_t *pos) {
-    iowrite32(pos->xcoor, BALL_XCOOR(dev.virtbase));
-    iowrite32(pos->ycoor, BALL_YCOOR(dev.virtbase));
-    // Note: dev.position is updated in the ioctl handler after calling this.
+static void vga_ball_put(struct vga_ball_dev *dev) {
+    kref_put(&dev->ref, vga_ball_free);
 }
 
-/* ioctl handler to service user requests */
-static long vga_ball_ioctl(struct file *f, unsigned int cmd, unsigned long arg) {
+/* Start a file operation that uses the device; -ENODEV once it is removed */
+static int vga_ball_enter(struct vga_ball_dev *dev) {
+    down_read(&dev->remove_lock);
+    if (dev->dead) {
+        up_read(&dev->remove_lock);
+        return -ENODEV;
+    }
+    return 0;
+}
+
+static void vga_ball_leave(struct vga_ball_dev *dev) {
+    up_read(&dev->remove_lock);
+}
+
+#ifdef CONFIG_DEBUG_FS
+static const char *const debug_cmd_names[DEBUG_NR_CMDS] = {
+    [_IOC_NR(VGA_BALL_WRITE_BACKGROUND)] = "WRITE_BACKGROUND",
+    [_IOC_NR(VGA_BALL_READ_BACKGROUND)]  = "READ_BACKGROUND",
+    [_IOC_NR(VGA_BALL_WRITE_POS)]        = "WRITE_POS",
+    [_IOC_NR(VGA_BALL_READ_POS)]         = "READ_POS",
+    [_IOC_NR(VGA_BALL_WRITE_FRAME)]      = "WRITE_FRAME",
+    [_IOC_NR(VGA_BALL_WAIT_VSYNC)]       = "WAIT_VSYNC",
+    [_IOC_NR(VGA_BALL_ANIMATE)]          = "ANIMATE",
+    [_IOC_NR(VGA_BALL_WRITE_SPRITES)]    = "WRITE_SPRITES",
+    [_IOC_NR(VGA_BALL_READ_STATS)]       = "READ_STATS",
+    [_IOC_NR(VGA_BALL_READ_CAPS)]        = "READ_CAPS",
+    [_IOC_NR(VGA_BALL_UPLOAD)]           = "UPLOAD",
+    [_IOC_NR(VGA_BALL_WRITE_PALETTE)]    = "WRITE_PALETTE",
+    [_IOC_NR(VGA_BALL_READ_TIMING)]      = "READ_TIMING",
+    [_IOC_NR(VGA_BALL_READ_CONFIG)]      = "READ_CONFIG",
+};
+
+static inline u64 debug_now(void) {
+    return ktime_get_ns();
+}
+
+/* Fold one measurement into l; called with dev->debug.lock held */
+static void debug_account(struct vga_ball_latency *l, u64 ns, u64 copy_ns, bool error) {
+    int bucket = fls64(ns >> 8);
+
+    l->calls++;
+    if (error)
+        l->errors++;
+    l->total_ns += ns;
+    l->copy_ns += copy_ns;
+    if (ns > l->max_ns)
+        l->max_ns = ns;
+    l->hist[min(bucket, DEBUG_BUCKETS - 1)]++;
+}
+
+static void debug_record_ioctl(struct vga_ball_dev *dev, unsigned int cmd, long ret, u64 ns, u64 copy_ns) {
+    unsigned long flags;
+
+    if (_IOC_TYPE(cmd) != VGA_BALL_MAGIC || _IOC_NR(cmd) >= DEBUG_NR_CMDS)
+        return;
+    spin_lock_irqsave(&dev->debug.lock, flags);
+    debug_account(&dev->debug.cmds[_IOC_NR(cmd)], ns, copy_ns, ret < 0);
+    spin_unlock_irqrestore(&dev->debug.lock, flags);
+}
+
+static void debug_record_commit(struct vga_ball_dev *dev, u64 ns) {
+    spin_lock(&dev->debug.lock);
+    debug_account(&dev->debug.commit, ns, 0, false);
+    spin_unlock(&dev->debug.lock);
+}
+
+static void debug_show_latency(struct seq_file *m, const char *name,
+                               const struct vga_ball_latency *l) {
+    int i;
+
+    if (l->calls == 0)
+        return;
+    seq_printf(m, "%-16s calls %llu errors %llu avg %llu ns max %llu ns copy avg %llu ns\n",
+               name, l->calls, l->errors, div64_u64(l->total_ns, l->calls), l->max_ns,
+               div64_u64(l->copy_ns, l->calls));
+    seq_puts(m, "                ");
+    for (i = 0; i < DEBUG_BUCKETS; i++) {
+        if (l->hist[i] == 0)
+            continue;
+        if (i == DEBUG_BUCKETS - 1)
+            seq_printf(m, " >=%lluns:%llu", 1ULL << (i + 7), l->hist[i]);
+        else
+            seq_printf(m, " <%lluns:%llu", 1ULL << (i + 8), l->hist[i]);
+    }
+    seq_puts(m, "\n");
+}
+
+static int debug_stats_show(struct seq_file *m, void *data) {
+    struct vga_ball_dev *dev = m->private;
+    struct vga_ball_latency *snap;
+    vga_ball_stats_t stats;
+    unsigned int seq;
+    int i;
+
+    snap = kmalloc_array(DEBUG_NR_CMDS + 1, sizeof(*snap), GFP_KERNEL);
+    if (snap == NULL)
+        return -ENOMEM;
+    spin_lock_irq(&dev->debug.lock);
+    memcpy(snap, dev->debug.cmds, sizeof(dev->debug.cmds));
+    snap[DEBUG_NR_CMDS] = dev->debug.commit;
+    spin_unlock_irq(&dev->debug.lock);
+    do {
+        seq = read_seqbegin(&dev->lock);
+        stats = dev->stats;
+    } while (read_seqretry(&dev->lock, seq));
+
+    for (i = 0; i < DEBUG_NR_CMDS; i++)
+        debug_show_latency(m, debug_cmd_names[i] ? debug_cmd_names[i] : "?", &snap[i]);
+    debug_show_latency(m, "vblank commit", &snap[DEBUG_NR_CMDS]);
+    seq_printf(m, "mmio writes %llu elided %llu\n", stats.mmio_writes, stats.mmio_elided);
+    kfree(snap);
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(debug_stats);
+
+/* Any write to the reset file clears the counters */
+static ssize_t debug_reset_write(struct file *f, const char __user *buf, size_t count, loff_t *ppos) {
+    struct vga_ball_dev *dev = f->private_data;
+    unsigned long flags;
+
+    spin_lock_irq(&dev->debug.lock);
+    memset(dev->debug.cmds, 0, sizeof(dev->debug.cmds));
+    memset(&dev->debug.commit, 0, sizeof(dev->debug.commit));
+    spin_unlock_irq(&dev->debug.lock);
+
+    write_seqlock_irqsave(&dev->lock, flags);
+    memset(&dev->stats, 0, sizeof(dev->stats));
+    write_sequnlock_irqrestore(&dev->lock, flags);
+    return count;
+}
+
+static const struct file_operations debug_reset_fops = {
+    .owner = THIS_MODULE,
+    .open  = simple_open,
+    .write = debug_reset_write,
+};
+
+static void debug_init(struct vga_ball_dev *dev) {
+    spin_lock_init(&dev->debug.lock);
+    dev->debug.dir = debugfs_create_dir(dev->name, NULL);
+    debugfs_create_file("stats", S_IRUGO, dev->debug.dir, dev, &debug_stats_fops);
+    debugfs_create_file("reset", S_IWUSR, dev->debug.dir, dev, &debug_reset_fops);
+}
+
+static void debug_exit(struct vga_ball_dev *dev) {
+    debugfs_remove_recursive(dev->debug.dir);
+}
+#else
+static inline u64 debug_now(void) { return 0; }
+static inline void debug_record_ioctl(struct vga_ball_dev *dev, unsigned int cmd, long ret, u64 ns, u64 copy_ns) {}
+static inline void debug_record_commit(struct vga_ball_dev *dev, u64 ns) {}
+static inline void debug_init(struct vga_ball_dev *dev) {}
+static inline void debug_exit(struct vga_ball_dev *dev) {}
+#endif
+
+/* Write val to a register unless the cache says it is already there */
+static void write_reg(struct vga_ball_dev *dev, void __iomem *addr, u32 val, u32 *hw, u32 *valid, u32 bit) {
+    if (dev->hw.trusted && (*valid & bit) && *hw == val) {
+        dev->stats.mmio_elided++;
+        return;
+    }
+    iowrite32(val, addr);
+    dev->stats.mmio_writes++;
+    *hw = val;
+    if (dev->hw.trusted)
+        *valid |= bit;
+}
+
+static void write_hw(struct vga_ball_dev *dev, unsigned int reg, void __iomem *addr, u32 val) {
+    write_reg(dev, addr, val, &dev->hw.regs[reg], &dev->hw.valid, BIT(reg));
+}
+
+/* Stop trusting anything the hardware held; called with dev->lock held */
+static void forget_hw(struct vga_ball_dev *dev) {
+    dev->hw.valid = 0;
+    dev->hw.sprite_pos_valid = 0;
+    dev->hw.sprite_attr_valid = 0;
+}
+
+/* Write the dirty shadow registers to hardware; called with dev->lock held */
+static void commit_shadow(struct vga_ball_dev *dev) {
+    unsigned int i;
+
+    dev->hw.trusted = !atomic_read(&dev->regs_mapped);
+    if (!dev->hw.trusted)
+        forget_hw(dev);
+
+    if (dev->caps & VGA_BALL_CAP_PACKED) {
+        if (dev->dirty & VGA_BALL_DIRTY_POS)
+            write_hw(dev, HW_XY, POS_XY(dev->virtbase),
+                     VGA_BALL_PACK_XY(dev->position.xcoor, dev->position.ycoor));
+        if (dev->dirty & VGA_BALL_DIRTY_BG)
+            write_hw(dev, HW_RGB, BG_RGB(dev->virtbase),
+                     VGA_BALL_PACK_RGB(dev->background.red, dev->background.green,
+                                       dev->background.blue));
+    } else {
+        if (dev->dirty & VGA_BALL_DIRTY_X)
+            write_hw(dev, HW_X, BALL_XCOOR(dev->virtbase), dev->position.xcoor);
+        if (dev->dirty & VGA_BALL_DIRTY_Y)
+            write_hw(dev, HW_Y, BALL_YCOOR(dev->virtbase), dev->position.ycoor);
+        if (dev->dirty & VGA_BALL_DIRTY_RED)
+            write_hw(dev, HW_RED, BG_RED(dev->virtbase), dev->background.red);
+        if (dev->dirty & VGA_BALL_DIRTY_GREEN)
+            write_hw(dev, HW_GREEN, BG_GREEN(dev->virtbase), dev->background.green);
+        if (dev->dirty & VGA_BALL_DIRTY_BLUE)
+            write_hw(dev, HW_BLUE, BG_BLUE(dev->virtbase), dev->background.blue);
+    }
+    if (dev->dirty & VGA_BALL_DIRTY_SCROLL)
+        write_hw(dev, HW_SCROLL, SCROLL_X(dev->virtbase), dev->scroll_x);
+    if (dev->dirty & VGA_BALL_DIRTY_BALL_FRAME)
+        write_hw(dev, HW_BALL_FRAME, BALL_FRAME(dev->virtbase), dev->ball_frame);
+    if (dev->dirty & VGA_BALL_DIRTY_BG_INDEX)
+        write_hw(dev, HW_BG_INDEX, BG_INDEX(dev->virtbase), dev->bg_index);
+    dev->dirty = 0;
+
+    while (dev->sprite_dirty) {
+        vga_ball_sprite_t *sp;
+
+        i = __ffs(dev->sprite_dirty);
+        sp = &dev->sprites[i];
+
+        write_reg(dev, SPRITE_POS(dev->virtbase, i), (u32)(u16)sp->ycoor << 16 | (u16)sp->xcoor,
+                  &dev->hw.sprite_pos[i], &dev->hw.sprite_pos_valid, BIT(i));
+        write_reg(dev, SPRITE_ATTR(dev->virtbase, i), sp->flags << 8 | sp->tile,
+                  &dev->hw.sprite_attr[i], &dev->hw.sprite_attr_valid, BIT(i));
+        dev->sprite_dirty &= ~BIT(i);
+    }
+
+    // Palette entries are only written when changed, so they aren't cached
+    for_each_set_bit(i, dev->palette_dirty, VGA_BALL_PALETTE_SIZE) {
+        iowrite32(dev->palette[i], PALETTE(dev->virtbase, i));
+        dev->stats.mmio_writes++;
+    }
+    bitmap_zero(dev->palette_dirty, VGA_BALL_PALETTE_SIZE);
+}
+
+/* Capability each shadow register field needs, by VGA_BALL_FIELD_* */
+static const unsigned int field_caps[VGA_BALL_NFIELDS] = {
+    [VGA_BALL_FIELD_SCROLL]     = VGA_BALL_CAP_TILEMAP,
+    [VGA_BALL_FIELD_BALL_FRAME] = VGA_BALL_CAP_PATTERNS,
+    [VGA_BALL_FIELD_BG_INDEX]   = VGA_BALL_CAP_PALETTE,
+};
+
+/* VGA_BALL_DIRTY_* bits of the fields this hardware has */
+static unsigned int supported_fields(struct vga_ball_dev *dev) {
+    unsigned int f, mask = 0;
+
+    for (f = 0; f < VGA_BALL_NFIELDS; f++) {
+        if ((dev->caps & field_caps[f]) == field_caps[f])
+            mask |= BIT(f);
+    }
+    return mask;
+}
+
+/*
+ * Write every shadow register, sprite and palette entry, trusting nothing
+ * the hardware held; called with dev->lock held, or before any vblank
+ * source runs.
+ */
+static void replay_shadow(struct vga_ball_dev *dev) {
+    forget_hw(dev);
+    dev->dirty = supported_fields(dev);
+    if (dev->caps & VGA_BALL_CAP_SPRITES)
+        dev->sprite_dirty = GENMASK(VGA_BALL_MAX_SPRITES - 1, 0);
+    if (dev->caps & VGA_BALL_CAP_PALETTE)
+        bitmap_fill(dev->palette_dirty, VGA_BALL_PALETTE_SIZE);
+    commit_shadow(dev);
+}
+
+/* Store the background color; it reaches hardware at the next vblank */
+static void write_background(struct vga_ball_dev *dev, vga_ball_color_t *background) {
+    unsigned long flags;
+
+    write_seqlock_irqsave(&dev->lock, flags);
+    dev->background = *background;
+    dev->dirty |= VGA_BALL_DIRTY_BG;
+    write_sequnlock_irqrestore(&dev->lock, flags);
+}
+
+/* Store the ball position; it reaches hardware at the next vblank */
+static void write_pos(struct vga_ball_dev *dev, vga_ball_pos_t *pos) {
+    unsigned long flags;
+
+    write_seqlock_irqsave(&dev->lock, flags);
+    dev->position = *pos;
+    dev->dirty |= VGA_BALL_DIRTY_POS;
+    write_sequnlock_irqrestore(&dev->lock, flags);
+}
+
+/* Store only the fields named in frame->dirty; called with dev->lock held */
+static void apply_frame(struct vga_ball_dev *dev, const vga_ball_frame_t *frame) {
+    if (frame->dirty & VGA_BALL_DIRTY_X)
+        dev->position.xcoor = frame->position.xcoor;
+    if (frame->dirty & VGA_BALL_DIRTY_Y)
+        dev->position.ycoor = frame->position.ycoor;
+    if (frame->dirty & VGA_BALL_DIRTY_RED)
+        dev->background.red = frame->background.red;
+    if (frame->dirty & VGA_BALL_DIRTY_GREEN)
+        dev->background.green = frame->background.green;
+    if (frame->dirty & VGA_BALL_DIRTY_BLUE)
+        dev->background.blue = frame->background.blue;
+    if (frame->dirty & VGA_BALL_DIRTY_SCROLL)
+        dev->scroll_x = frame->scroll_x;
+    if (frame->dirty & VGA_BALL_DIRTY_BALL_FRAME)
+        dev->ball_frame = frame->ball_frame;
+    if (frame->dirty & VGA_BALL_DIRTY_BG_INDEX)
+        dev->bg_index = frame->bg_index;
+    dev->dirty |= frame->dirty;
+}
+
+static void write_frame(struct vga_ball_dev *dev, vga_ball_frame_t *frame) {
+    unsigned long flags;
+
+    write_seqlock_irqsave(&dev->lock, flags);
+    apply_frame(dev, frame);
+    write_sequnlock_irqrestore(&dev->lock, flags);
+}
+
+/*
+ * Apply the oldest ring entry if it is due by frame; called with dev->lock
+ * held.  Everything in the ring is written by userspace, so the head index
+ * is sanity-checked and each entry is copied out before it is used.
+ */
+static void drain_ring(struct vga_ball_dev *dev, u32 frame) {
+    vga_ball_ring_t *ring = dev->ring;
+    u32 head = smp_load_acquire(&ring->head);
+    vga_ball_cmd_t *cmd;
+    vga_ball_frame_t update;
+
+    if (head == dev->ring_tail) {
+        return;
+    }
+    if (head - dev->ring_tail > VGA_BALL_RING_SIZE) {
+        // Producer went past the ring; drop everything it queued
+        dev->ring_tail = head;
+        smp_store_release(&ring->tail, dev->ring_tail);
+        return;
+    }
+
+    cmd = &ring->cmds[dev->ring_tail & (VGA_BALL_RING_SIZE - 1)];
+    if ((s32)(frame - READ_ONCE(cmd->frame)) < 0) {
+        return;  // not due yet
+    }
+    update.position = cmd->position;
+    update.background = cmd->background;
+    update.dirty = READ_ONCE(cmd->dirty) & VGA_BALL_DIRTY_ALL;
+    apply_frame(dev, &update);
+
+    dev->ring_tail++;
+    smp_store_release(&ring->tail, dev->ring_tail);
+}
+
+/* Apply every queued write() record; called with dev->lock held */
+static void drain_updates(struct vga_ball_dev *dev) {
+    vga_ball_update_t up;
+
+    while (kfifo_get(&dev->updates, &up)) {
+        switch (up.field) {
+        case VGA_BALL_FIELD_X:      dev->position.xcoor = up.value; break;
+        case VGA_BALL_FIELD_Y:      dev->position.ycoor = up.value; break;
+        case VGA_BALL_FIELD_RED:    dev->background.red = up.value; break;
+        case VGA_BALL_FIELD_GREEN:  dev->background.green = up.value; break;
+        case VGA_BALL_FIELD_BLUE:   dev->background.blue = up.value; break;
+        case VGA_BALL_FIELD_SCROLL: dev->scroll_x = up.value; break;
+        case VGA_BALL_FIELD_BALL_FRAME: dev->ball_frame = up.value; break;
+        case VGA_BALL_FIELD_BG_INDEX: dev->bg_index = up.value; break;
+        }
+        dev->dirty |= BIT(up.field);
+    }
+}
+
+/* Store a range of sprite table entries; they reach hardware at the next vblank */
+static int write_sprites(struct vga_ball_dev *dev, const vga_ball_sprites_t *table) {
+    unsigned long flags;
+    unsigned int i;
+
+    if (!(dev->caps & VGA_BALL_CAP_SPRITES)) {
+        return -ENODEV;
+    }
+    if (table->first >= VGA_BALL_MAX_SPRITES || table->count > VGA_BALL_MAX_SPRITES - table->first) {
+        return -EINVAL;
+    }
+
+    write_seqlock_irqsave(&dev->lock, flags);
+    for (i = 0; i < table->count; i++) {
+        dev->sprites[table->first + i] = table->sprites[i];
+        dev->sprite_dirty |= BIT(table->first + i);
+    }
+    write_sequnlock_irqrestore(&dev->lock, flags);
+    return 0;
+}
+
+/* Store a range of palette entries; they reach hardware together at the next vblank */
+static int write_palette(struct vga_ball_dev *dev, const vga_ball_palette_t *pal) {
+    unsigned long flags;
+    unsigned int i;
+
+    if (!(dev->caps & VGA_BALL_CAP_PALETTE)) {
+        return -ENODEV;
+    }
+    if (pal->first >= VGA_BALL_PALETTE_SIZE || pal->count > VGA_BALL_PALETTE_SIZE - pal->first) {
+        return -EINVAL;
+    }
+
+    write_seqlock_irqsave(&dev->lock, flags);
+    for (i = 0; i < pal->count; i++) {
+        dev->palette[pal->first + i] = pal->colors[i] & 0xffffff;
+    }
+    bitmap_set(dev->palette_dirty, pal->first, pal->count);
+    write_sequnlock_irqrestore(&dev->lock, flags);
+    return 0;
+}
+
+/* Device memory VGA_BALL_UPLOAD may write, and the capability it needs */
+static const struct {
+    u32 start, end;
+    unsigned int cap;
+} upload_regions[] = {
+    { VGA_BALL_REG_TILEMAP, VGA_BALL_REG_TILEMAP_END, VGA_BALL_CAP_TILEMAP },
+    { VGA_BALL_REG_TILES,   VGA_BALL_REG_TILES_END,   VGA_BALL_CAP_TILEMAP },
+    { VGA_BALL_REG_PATTERNS, VGA_BALL_REG_PATTERNS_END, VGA_BALL_CAP_PATTERNS },
+};
+
+/*
+ * Copy from the staging buffer to device memory.  There is no DMA channel
+ * to the display core, so this is a CPU copy of consecutive 32-bit words,
+ * which the bridge turns into bursts; iowrite32_rep would hammer a single
+ * FIFO address instead.
+ */
+static int upload(struct vga_ball_dev *dev, const vga_ball_upload_t *up) {
+    unsigned long flags;
+    unsigned int i;
+
+    if ((up->offset | up->src | up->len) & 3) {
+        return -EINVAL;
+    }
+    if (up->src > VGA_BALL_STAGING_SIZE || up->len > VGA_BALL_STAGING_SIZE - up->src) {
+        return -EINVAL;
+    }
+    for (i = 0; i < ARRAY_SIZE(upload_regions); i++) {
+        if (up->offset >= upload_regions[i].start && up->offset < upload_regions[i].end &&
+            up->len <= upload_regions[i].end - up->offset) {
+            break;
+        }
+    }
+    if (i == ARRAY_SIZE(upload_regions)) {
+        return -EINVAL;
+    }
+    if (!(dev->caps & upload_regions[i].cap)) {
+        return -ENODEV;
+    }
+
+    __iowrite32_copy(dev->virtbase + up->offset, dev->staging + up->src, up->len / 4);
+
+    write_seqlock_irqsave(&dev->lock, flags);
+    dev->stats.mmio_writes += up->len / 4;
+    write_sequnlock_irqrestore(&dev->lock, flags);
+    return 0;
+}
+
+/* Map segment progress t (Q16.16, 0..1) through an easing curve */
+static u32 ease(unsigned int type, u32 t) {
+    u32 r;
+
+    switch (type) {
+    case VGA_BALL_EASE_IN:
+        return ((u64)t * t) >> 16;
+    case VGA_BALL_EASE_OUT:
+        r = 0x10000 - t;
+        return 0x10000 - (u32)(((u64)r * r) >> 16);
+    case VGA_BALL_EASE_IN_OUT:
+        // t * t * (3 - 2t)
+        r = ((u64)t * t) >> 16;
+        return ((u64)r * (0x30000 - 2 * t)) >> 16;
+    default:
+        return t;
+    }
+}
+
+static s32 lerp(s32 from, s32 to, u32 t) {
+    return from + (s32)(((s64)(to - from) * t) >> 16);
+}
+
+/* Advance the animation by one vblank; called with dev->lock held */
+static void step_anim(struct vga_ball_dev *dev) {
+    struct vga_ball_anim *a = &dev->anim;
+    const vga_ball_keyframe_t *k;
+    u32 t = 0x10000;
+
+    if (a->key >= a->desc.count) {
+        return;
+    }
+    k = &a->desc.keys[a->key];
+
+    a->frame++;
+    if (a->frame < k->frames) {
+        t = ease(k->ease, (a->frame << 16) / k->frames);
+    }
+    dev->position.xcoor = (lerp(a->from_x, k->xcoor, t) + 0x8000) >> 16;
+    dev->position.ycoor = (lerp(a->from_y, k->ycoor, t) + 0x8000) >> 16;
+    dev->dirty |= VGA_BALL_DIRTY_POS;
+
+    if (a->frame >= k->frames) {
+        // Keyframe reached: start the next segment from it exactly
+        a->from_x = k->xcoor;
+        a->from_y = k->ycoor;
+        a->frame = 0;
+        if (++a->key == a->desc.count && (a->desc.flags & VGA_BALL_ANIM_LOOP)) {
+            a->key = 0;
+        }
+    }
+}
+
+/* Replace the current animation, starting from the current position */
+static int write_anim(struct vga_ball_dev *dev, const vga_ball_anim_t *desc) {
+    unsigned long flags;
+    unsigned int i;
+
+    if (desc->count > VGA_BALL_MAX_KEYFRAMES || (desc->flags & ~VGA_BALL_ANIM_LOOP)) {
+        return -EINVAL;
+    }
+    for (i = 0; i < desc->count; i++) {
+        if (desc->keys[i].frames > 0xffff || desc->keys[i].ease > VGA_BALL_EASE_IN_OUT) {
+            return -EINVAL;
+        }
+    }
+
+    write_seqlock_irqsave(&dev->lock, flags);
+    dev->anim.desc = *desc;
+    dev->anim.key = 0;
+    dev->anim.frame = 0;
+    dev->anim.from_x = VGA_BALL_FIX(dev->position.xcoor);
+    dev->anim.from_y = VGA_BALL_FIX(dev->position.ycoor);
+    write_sequnlock_irqrestore(&dev->lock, flags);
+    return 0;
+}
+
+/* Called once per vertical blank, from the IRQ or the software timer */
+static void vga_ball_vblank(struct vga_ball_dev *dev) {
+    u32 frame = dev->frame_count + 1;
+    u64 start;
+
+    write_seqlock(&dev->lock);
+    dev->vblank_ns = ktime_get_ns();
+    if (dev->caps & VGA_BALL_CAP_TIMING)
+        dev->vblank_hw_frame = ioread32(FRAME_COUNT(dev->virtbase));
+    drain_ring(dev, frame);
+    drain_updates(dev);
+    step_anim(dev);
+    start = debug_now();
+    commit_shadow(dev);
+    debug_record_commit(dev, debug_now() - start);
+    // Inside the lock so READ_TIMING sees the count and its timestamp together
+    WRITE_ONCE(dev->frame_count, frame);
+    write_sequnlock(&dev->lock);
+
+    WRITE_ONCE(dev->ring->frame, frame);
+    wake_up_interruptible(&dev->vsync_wait);
+}
+
+static irqreturn_t vga_ball_irq(int irq, void *data) {
+    struct vga_ball_dev *dev = data;
+
+    iowrite32(1, IRQ_ACK(dev->virtbase));
+    vga_ball_vblank(dev);
+    return IRQ_HANDLED;
+}
+
+static enum hrtimer_restart vga_ball_vsync_timer(struct hrtimer *timer) {
+    struct vga_ball_dev *dev = container_of(timer, struct vga_ball_dev, vsync_timer);
+
+    vga_ball_vblank(dev);
+    hrtimer_forward_now(timer, ns_to_ktime(VSYNC_PERIOD_NS));
+    return HRTIMER_RESTART;
+}
+
+/* Run vblanks only while the device is powered; the IRQ is requested disabled */
+static void vblank_start(struct vga_ball_dev *dev) {
+    if (dev->irq)
+        enable_irq(dev->irq);
+    else
+        hrtimer_start(&dev->vsync_timer, ns_to_ktime(VSYNC_PERIOD_NS), HRTIMER_MODE_REL);
+}
+
+static void vblank_stop(struct vga_ball_dev *dev) {
+    if (dev->irq)
+        disable_irq(dev->irq);
+    else
+        hrtimer_cancel(&dev->vsync_timer);
+}
+
+/* Wait until the frame count moves past frame; returns the new count */
+static int wait_frame(struct vga_ball_dev *dev, u32 frame, u32 *next) {
+    if (wait_event_interruptible(dev->vsync_wait, READ_ONCE(dev->frame_count) != frame ||
+                                 READ_ONCE(dev->dead))) {
+        return -ERESTARTSYS;
+    }
+    if (READ_ONCE(dev->dead)) {
+        return -ENODEV;
+    }
+    *next = READ_ONCE(dev->frame_count);
+    return 0;
+}
+
+/* The last vblank, paired with a reading of where scan-out is now */
+static void read_timing(struct vga_ball_dev *dev, vga_ball_timing_t *t) {
+    unsigned int seq;
+
+    memset(t, 0, sizeof(*t));
+    do {
+        seq = read_seqbegin(&dev->lock);
+        t->frame = dev->frame_count;
+        t->hw_frame = dev->vblank_hw_frame;
+        t->vblank_ns = dev->vblank_ns;
+    } while (read_seqretry(&dev->lock, seq));
+
+    if (dev->caps & VGA_BALL_CAP_TIMING) {
+        t->scanline = ioread32(SCANLINE(dev->virtbase));
+        t->hw_frame_now = ioread32(FRAME_COUNT(dev->virtbase));
+    }
+    t->now_ns = ktime_get_ns();
+}
+
+/* copy_from_user/copy_to_user that add the time they take to *ns */
+static unsigned long timed_copy_from_user(void *to, const void __user *from,
+                                          unsigned long n, u64 *ns) {
+    u64 start = debug_now();
+    unsigned long ret = copy_from_user(to, from, n);
+
+    *ns += debug_now() - start;
+    return ret;
+}
+
+static unsigned long timed_copy_to_user(void __user *to, const void *from,
+                                        unsigned long n, u64 *ns) {
+    u64 start = debug_now();
+    unsigned long ret = copy_to_user(to, from, n);
+
+    *ns += debug_now() - start;
+    return ret;
+}
+
+/*
+ * Every ioctl argument but the two too big for the stack.  The argument is
+ * copied in before remove_lock is taken and out after it is dropped: a
+ * user copy can fault and take mmap_sem, which mmap() and the fault
+ * handler hold while they take remove_lock.
+ */
+union vga_ball_ioctl_arg {
     vga_ball_arg_t vla;
     vga_ball_pos_t bpos;
+    vga_ball_frame_t frame;
+    vga_ball_sprites_t sprites;
+    vga_ball_stats_t stats;
+    vga_ball_upload_t up;
+    vga_ball_timing_t timing;
+    vga_ball_config_t config;
+    unsigned int value;
+};
+
+/*
+ * Bytes each ioctl copies in or out, by _IOC_NR.  The POS ioctls were
+ * numbered with vga_ball_arg_t but take a vga_ball_pos_t, so _IOC_SIZE()
+ * won't do.
+ */
+static const unsigned short ioctl_arg_size[] = {
+    [_IOC_NR(VGA_BALL_WRITE_BACKGROUND)] = sizeof(vga_ball_arg_t),
+    [_IOC_NR(VGA_BALL_READ_BACKGROUND)]  = sizeof(vga_ball_arg_t),
+    [_IOC_NR(VGA_BALL_WRITE_POS)]        = sizeof(vga_ball_pos_t),
+    [_IOC_NR(VGA_BALL_READ_POS)]         = sizeof(vga_ball_pos_t),
+    [_IOC_NR(VGA_BALL_WRITE_FRAME)]      = sizeof(vga_ball_frame_t),
+    [_IOC_NR(VGA_BALL_WAIT_VSYNC)]       = sizeof(unsigned int),
+    [_IOC_NR(VGA_BALL_ANIMATE)]          = sizeof(vga_ball_anim_t),
+    [_IOC_NR(VGA_BALL_WRITE_SPRITES)]    = sizeof(vga_ball_sprites_t),
+    [_IOC_NR(VGA_BALL_READ_STATS)]       = sizeof(vga_ball_stats_t),
+    [_IOC_NR(VGA_BALL_READ_CAPS)]        = sizeof(unsigned int),
+    [_IOC_NR(VGA_BALL_UPLOAD)]           = sizeof(vga_ball_upload_t),
+    [_IOC_NR(VGA_BALL_WRITE_PALETTE)]    = sizeof(vga_ball_palette_t),
+    [_IOC_NR(VGA_BALL_READ_TIMING)]      = sizeof(vga_ball_timing_t),
+    [_IOC_NR(VGA_BALL_READ_CONFIG)]      = sizeof(vga_ball_config_t),
+};
+
+/* ioctl handler body, on the argument already in kernel memory */
+static long do_ioctl(struct vga_ball_file *vf, unsigned int cmd, void *arg) {
+    struct vga_ball_dev *dev = vf->dev;
+    union vga_ball_ioctl_arg *a = arg;
+    unsigned int seq;
     long status = 0;
 
     switch (cmd) {
     case VGA_BALL_WRITE_BACKGROUND:
-        if (copy_from_user(&vla, (vga_ball_arg_t __user *)arg, sizeof(vga_ball_arg_t))) {
-            return -EACCES;
-        }
-        write_background(&vla.background);
+        write_background(dev, &a->vla.background);
         break;
 
     case VGA_BALL_READ_BACKGROUND:
-        vla.background = dev.background;
-        if (copy_to_user((vga_ball_arg_t __user *)arg, &vla, sizeof(vga_ball_arg_t))) {
-            return -EACCES;
-        }
+        do {
+            seq = read_seqbegin(&dev->lock);
+            a->vla.background = dev->background;
+        } while (read_seqretry(&dev->lock, seq));
         break;
 
     case VGA_BALL_WRITE_POS:
-        if (copy_from_user(&bpos, (vga_ball_pos_t __user *)arg, sizeof(vga_ball_pos_t))) {
-            return -EACCES;
-        }
-        write_pos(&bpos);
-        dev.position = bpos;  // update stored position
+        write_pos(dev, &a->bpos);
         break;
 
     case VGA_BALL_READ_POS:
-        bpos = dev.position;
-        if (copy_to_user((vga_ball_pos_t __user *)arg, &bpos, sizeof(vga_ball_pos_t))) {
-            return -EACCES;
+        do {
+            seq = read_seqbegin(&dev->lock);
+            a->bpos = dev->position;
+        } while (read_seqretry(&dev->lock, seq));
+        break;
+
+    case VGA_BALL_WRITE_FRAME:
+        if (a->frame.dirty & ~VGA_BALL_DIRTY_FRAME) {
+            return -EINVAL;
+        }
+        if (a->frame.dirty & ~supported_fields(dev)) {
+            return -ENODEV;
+        }
+        write_frame(dev, &a->frame);
+        break;
+
+    case VGA_BALL_WAIT_VSYNC:
+        status = wait_frame(dev, READ_ONCE(dev->frame_count), &a->value);
+        if (status) {
+            return status;
         }
+        vf->last_frame = a->value;
+        break;
+
+    case VGA_BALL_ANIMATE:
+        status = write_anim(dev, arg);
+        break;
+
+    case VGA_BALL_WRITE_SPRITES:
+        status = write_sprites(dev, &a->sprites);
+        break;
+
+    case VGA_BALL_READ_STATS:
+        do {
+            seq = read_seqbegin(&dev->lock);
+            a->stats = dev->stats;
+        } while (read_seqretry(&dev->lock, seq));
+        break;
+
+    case VGA_BALL_READ_CAPS:
+        a->value = dev->caps;
+        break;
+
+    case VGA_BALL_READ_CONFIG:
+        a->config = vga_ball_config;
+        break;
+
+    case VGA_BALL_WRITE_PALETTE:
+        status = write_palette(dev, arg);
+        break;
+
+    case VGA_BALL_READ_TIMING:
+        read_timing(dev, &a->timing);
+        break;
+
+    case VGA_BALL_UPLOAD:
+        // Only the file that fills the buffer may copy out of it
+        if (READ_ONCE(dev->staging_owner) != vf) {
+            return -EBUSY;
+        }
+        status = upload(dev, &a->up);
         break;
 
     default:
@@ -88,72 +988,576 @@ static long vga_ball_ioctl(struct file *f, unsigned int cmd, unsigned long arg)
     return status;
 }
 
+static long vga_ball_ioctl(struct file *f, unsigned int cmd, unsigned long arg) {
+    struct vga_ball_file *vf = f->private_data;
+    union vga_ball_ioctl_arg small;
+    void *karg = &small;
+    unsigned int size;
+    u64 start = debug_now();
+    u64 copy_ns = 0;
+    long ret;
+
+    if (_IOC_TYPE(cmd) != VGA_BALL_MAGIC || _IOC_NR(cmd) >= ARRAY_SIZE(ioctl_arg_size)) {
+        ret = -EINVAL;
+        goto out;
+    }
+    size = ioctl_arg_size[_IOC_NR(cmd)];
+    if (size > sizeof(small)) {
+        karg = kmalloc(size, GFP_KERNEL);
+        if (karg == NULL) {
+            ret = -ENOMEM;
+            goto out;
+        }
+    }
+    if ((_IOC_DIR(cmd) & _IOC_WRITE) &&
+        timed_copy_from_user(karg, (void __user *)arg, size, &copy_ns)) {
+        ret = -EACCES;
+        goto out;
+    }
+
+    ret = vga_ball_enter(vf->dev);
+    if (ret) {
+        goto out;
+    }
+    ret = do_ioctl(vf, cmd, karg);
+    vga_ball_leave(vf->dev);
+
+    if (ret == 0 && (_IOC_DIR(cmd) & _IOC_READ) &&
+        timed_copy_to_user((void __user *)arg, karg, size, &copy_ns)) {
+        ret = -EACCES;
+    }
+out:
+    debug_record_ioctl(vf->dev, cmd, ret, debug_now() - start, copy_ns);
+    if (karg != &small) {
+        kfree(karg);
+    }
+    return ret;
+}
+
+/*
+ * The misc core hands us our miscdevice in f->private_data, under the lock
+ * misc_deregister() takes, so the device can't be removed while we take
+ * our reference.  Each open file keeps the device powered.
+ */
+static int vga_ball_open(struct inode *inode, struct file *f) {
+    struct vga_ball_dev *dev = container_of(f->private_data, struct vga_ball_dev, misc);
+    struct vga_ball_file *vf;
+    int ret;
+
+    vf = kzalloc(sizeof(*vf), GFP_KERNEL);
+    if (vf == NULL) {
+        return -ENOMEM;
+    }
+    ret = pm_runtime_get_sync(dev->device);
+    if (ret < 0) {
+        pm_runtime_put_noidle(dev->device);
+        kfree(vf);
+        return ret;
+    }
+    kref_get(&dev->ref);
+    vf->dev = dev;
+    vf->last_frame = READ_ONCE(dev->frame_count);
+    vf->mapping = f->f_mapping;
+    mutex_lock(&dev->files_lock);
+    list_add(&vf->node, &dev->files);
+    mutex_unlock(&dev->files_lock);
+    f->private_data = vf;
+    return nonseekable_open(inode, f);
+}
+
+static int vga_ball_release(struct inode *inode, struct file *f) {
+    struct vga_ball_file *vf = f->private_data;
+    struct vga_ball_dev *dev = vf->dev;
+
+    // Release the ring and the staging buffer for the next owner; their
+    // mappings are gone by now
+    cmpxchg(&dev->ring_owner, vf, NULL);
+    cmpxchg(&dev->staging_owner, vf, NULL);
+    mutex_lock(&dev->files_lock);
+    list_del(&vf->node);
+    mutex_unlock(&dev->files_lock);
+    kfree(vf);
+
+    pm_runtime_mark_last_busy(dev->device);
+    pm_runtime_put_autosuspend(dev->device);
+    // Frees the device if it was removed while we had it open
+    vga_ball_put(dev);
+    return 0;
+}
+
+/* read handler: block for a vblank this file has not seen, return its count */
+static ssize_t vga_ball_read(struct file *f, char __user *buf, size_t count, loff_t *ppos) {
+    struct vga_ball_file *vf = f->private_data;
+    struct vga_ball_dev *dev = vf->dev;
+    u32 frame = READ_ONCE(dev->frame_count);
+    int ret;
+
+    if (count < sizeof(u32)) {
+        return -EINVAL;
+    }
+    if (READ_ONCE(dev->dead)) {
+        return -ENODEV;
+    }
+
+    if (frame == vf->last_frame) {
+        if (f->f_flags & O_NONBLOCK) {
+            return -EAGAIN;
+        }
+        ret = wait_frame(dev, vf->last_frame, &frame);
+        if (ret) {
+            return ret;
+        }
+    }
+
+    if (copy_to_user(buf, &frame, sizeof(u32))) {
+        return -EFAULT;
+    }
+    vf->last_frame = frame;
+    return sizeof(u32);
+}
+
+/*
+ * write handler: queue whole vga_ball_update_t records for the next vblank.
+ * Records are checked a chunk at a time before any of the chunk is queued;
+ * a bad one ends the write there.
+ */
+#define WRITE_CHUNK 16
+
+static ssize_t vga_ball_write(struct file *f, const char __user *buf, size_t count, loff_t *ppos) {
+    struct vga_ball_file *vf = f->private_data;
+    struct vga_ball_dev *dev = vf->dev;
+    vga_ball_update_t chunk[WRITE_CHUNK];
+    size_t done = 0;
+    unsigned int n, i;
+    ssize_t ret = 0;
+
+    if (count % sizeof(vga_ball_update_t)) {
+        return -EINVAL;
+    }
+    if (mutex_lock_interruptible(&dev->write_lock)) {
+        return -ERESTARTSYS;
+    }
+
+    while (done < count) {
+        // Nothing drains the queue once the device is removed
+        if (READ_ONCE(dev->dead)) {
+            ret = -ENODEV;
+            break;
+        }
+        if (kfifo_is_full(&dev->updates)) {
+            if (f->f_flags & O_NONBLOCK) {
+                ret = -EAGAIN;
+                break;
+            }
+            // The vblank that drains the queue wakes us
+            if (wait_event_interruptible(dev->vsync_wait, !kfifo_is_full(&dev->updates) ||
+                                         READ_ONCE(dev->dead))) {
+                ret = -ERESTARTSYS;
+                break;
+            }
+            continue;
+        }
+
+        n = min_t(size_t, (count - done) / sizeof(vga_ball_update_t),
+                  min_t(unsigned int, WRITE_CHUNK, kfifo_avail(&dev->updates)));
+        if (copy_from_user(chunk, buf + done, n * sizeof(vga_ball_update_t))) {
+            ret = -EFAULT;
+            break;
+        }
+        for (i = 0; i < n; i++) {
+            if (chunk[i].field >= VGA_BALL_NFIELDS || !(supported_fields(dev) & BIT(chunk[i].field))) {
+                ret = -EINVAL;
+                break;
+            }
+        }
+        kfifo_in(&dev->updates, chunk, i);
+        done += i * sizeof(vga_ball_update_t);
+        if (ret) {
+            break;
+        }
+    }
+
+    mutex_unlock(&dev->write_lock);
+    return done ? done : ret;
+}
+
+static __poll_t vga_ball_poll(struct file *f, poll_table *wait) {
+    struct vga_ball_file *vf = f->private_data;
+    struct vga_ball_dev *dev = vf->dev;
+    __poll_t mask = 0;
+
+    poll_wait(f, &dev->vsync_wait, wait);
+    if (READ_ONCE(dev->dead)) {
+        return EPOLLERR | EPOLLHUP;
+    }
+    if (READ_ONCE(dev->frame_count) != vf->last_frame) {
+        mask |= EPOLLIN | EPOLLRDNORM;
+    }
+    if (!kfifo_is_full(&dev->updates)) {
+        mask |= EPOLLOUT | EPOLLWRNORM;
+    }
+    return mask;
+}
+
+/* Track user mappings of the registers; see struct vga_ball_hw */
+static void vga_ball_vm_open(struct vm_area_struct *vma) {
+    struct vga_ball_dev *dev = vma->vm_private_data;
+    unsigned long flags;
+
+    atomic_inc(&dev->regs_mapped);
+    write_seqlock_irqsave(&dev->lock, flags);
+    forget_hw(dev);
+    write_sequnlock_irqrestore(&dev->lock, flags);
+}
+
+static void vga_ball_vm_close(struct vm_area_struct *vma) {
+    struct vga_ball_dev *dev = vma->vm_private_data;
+
+    atomic_dec(&dev->regs_mapped);
+}
+
+/*
+ * Register pages are mapped as they are touched, so none can be mapped
+ * once the device is removed, however the mmap() raced with the removal
+ */
+static vm_fault_t vga_ball_vm_fault(struct vm_fault *vmf) {
+    struct vga_ball_dev *dev = vmf->vma->vm_private_data;
+    vm_fault_t ret;
+
+    if (vga_ball_enter(dev)) {
+        return VM_FAULT_SIGBUS;
+    }
+    ret = vmf_insert_pfn(vmf->vma, vmf->address, (dev->res.start >> PAGE_SHIFT) + vmf->pgoff);
+    vga_ball_leave(dev);
+    return ret;
+}
+
+static const struct vm_operations_struct vga_ball_vm_ops = {
+    .open  = vga_ball_vm_open,
+    .close = vga_ball_vm_close,
+    .fault = vga_ball_vm_fault,
+};
+
+/*
+ * mmap handler: map the register window, uncached, into the caller, the
+ * command ring at offset VGA_BALL_MMAP_RING, or the upload staging buffer at
+ * VGA_BALL_MMAP_STAGING.  Only one open file at a time may map the ring,
+ * and likewise the staging buffer; others get -EBUSY until it is closed.
+ * Register writes through the mapping bypass the shadow position and
+ * background, so VGA_BALL_READ_POS and VGA_BALL_READ_BACKGROUND will not
+ * see them.
+ */
+static int map_device(struct file *f, struct vm_area_struct *vma) {
+    struct vga_ball_file *vf = f->private_data;
+    struct vga_ball_dev *dev = vf->dev;
+    struct vga_ball_file *owner;
+    int ret;
+
+    if (vma->vm_pgoff == VGA_BALL_MMAP_RING >> PAGE_SHIFT) {
+        // The ring has a single producer: the first file to map it
+        owner = cmpxchg(&dev->ring_owner, NULL, vf);
+        if (owner != NULL && owner != vf) {
+            return -EBUSY;
+        }
+        ret = remap_vmalloc_range(vma, dev->ring, 0);
+        if (ret && owner == NULL) {
+            cmpxchg(&dev->ring_owner, vf, NULL);
+        }
+        return ret;
+    }
+
+    if (vma->vm_pgoff == VGA_BALL_MMAP_STAGING >> PAGE_SHIFT) {
+        // Another file's fill could land between ours and our upload
+        owner = cmpxchg(&dev->staging_owner, NULL, vf);
+        if (owner != NULL && owner != vf) {
+            return -EBUSY;
+        }
+        ret = remap_vmalloc_range(vma, dev->staging, 0);
+        if (ret && owner == NULL) {
+            cmpxchg(&dev->staging_owner, vf, NULL);
+        }
+        return ret;
+    }
+
+    // Userspace addresses registers from the start of the mapping
+    if (dev->res.start & ~PAGE_MASK) {
+        return -ENODEV;
+    }
+
+    if (vma->vm_pgoff + vma_pages(vma) > PAGE_ALIGN(resource_size(&dev->res)) >> PAGE_SHIFT) {
+        return -EINVAL;
+    }
+    vma->vm_page_prot = pgprot_noncached(vma->vm_page_prot);
+    vma->vm_flags |= VM_IO | VM_PFNMAP | VM_DONTEXPAND | VM_DONTDUMP;
+    vma->vm_ops = &vga_ball_vm_ops;
+    vma->vm_private_data = dev;
+    vga_ball_vm_open(vma);
+    return 0;
+}
+
+static int vga_ball_mmap(struct file *f, struct vm_area_struct *vma) {
+    struct vga_ball_file *vf = f->private_data;
+    int ret;
+
+    ret = vga_ball_enter(vf->dev);
+    if (ret) {
+        return ret;
+    }
+    ret = map_device(f, vma);
+    vga_ball_leave(vf->dev);
+    return ret;
+}
+
 /* File operations structure for the misc device */
 static const struct file_operations vga_ball_fops = {
     .owner          = THIS_MODULE,
+    .open           = vga_ball_open,
+    .release        = vga_ball_release,
+    .read           = vga_ball_read,
+    .write          = vga_ball_write,
+    .poll           = vga_ball_poll,
     .unlocked_ioctl = vga_ball_ioctl,
+    .mmap           = vga_ball_mmap,
+    .llseek         = no_llseek,
 };
 
-/* Misc device structure */
-static struct miscdevice vga_ball_misc_device = {
-    .minor = MISC_DYNAMIC_MINOR,
-    .name  = DRIVER_NAME,
-    .fops  = &vga_ball_fops,
+#ifdef CONFIG_PM
+/* Nothing has the device open: stop vblanks and gate the bridge clock */
+static int vga_ball_runtime_suspend(struct device *d) {
+    struct vga_ball_dev *dev = dev_get_drvdata(d);
+
+    vblank_stop(dev);
+    clk_disable_unprepare(dev->clk);
+    return 0;
+}
+
+/*
+ * The fabric may have been reconfigured while the bridge was gated, so the
+ * cached shadow state goes back to hardware in one commit before vblanks
+ * restart.  Tile and pattern memory isn't shadowed; whoever opens the
+ * device next uploads it again.
+ */
+static int vga_ball_runtime_resume(struct device *d) {
+    struct vga_ball_dev *dev = dev_get_drvdata(d);
+    unsigned long flags;
+    int ret;
+
+    ret = clk_prepare_enable(dev->clk);
+    if (ret)
+        return ret;
+    write_seqlock_irqsave(&dev->lock, flags);
+    replay_shadow(dev);
+    write_sequnlock_irqrestore(&dev->lock, flags);
+    vblank_start(dev);
+    return 0;
+}
+#endif
+
+static const struct dev_pm_ops vga_ball_pm_ops = {
+    SET_SYSTEM_SLEEP_PM_OPS(pm_runtime_force_suspend, pm_runtime_force_resume)
+    SET_RUNTIME_PM_OPS(vga_ball_runtime_suspend, vga_ball_runtime_resume, NULL)
 };
 
-/* Probe function: called when the device is initialized */
-static int __init vga_ball_probe(struct platform_device *pdev) {
+/* devm actions */
+static void vga_ball_put_action(void *data) {
+    vga_ball_put(data);
+}
+
+static void vga_ball_ida_remove(void *data) {
+    struct vga_ball_dev *dev = data;
+
+    ida_simple_remove(&vga_ball_ida, dev->id);
+}
+
+/* Probe function: called for each display controller in the device tree */
+static int vga_ball_probe(struct platform_device *pdev) {
     vga_ball_color_t beige = {0xf9, 0xe4, 0xb7};  // default background color
+    struct vga_ball_dev *dev;
+    struct resource *res;
     int ret;
 
-    // Register the misc device (creates /dev/vga_ball)
-    ret = misc_register(&vga_ball_misc_device);
+    // Not devm: open files can keep it past remove.  The bound driver's
+    // reference goes with the other devm resources.
+    dev = kzalloc(sizeof(*dev), GFP_KERNEL);
+    if (dev == NULL) {
+        return -ENOMEM;
+    }
+    kref_init(&dev->ref);
+    dev->device = get_device(&pdev->dev);
+    ret = devm_add_action_or_reset(&pdev->dev, vga_ball_put_action, dev);
     if (ret) {
-        pr_err(DRIVER_NAME ": misc device registration failed\n");
         return ret;
     }
+    init_rwsem(&dev->remove_lock);
+    mutex_init(&dev->files_lock);
+    INIT_LIST_HEAD(&dev->files);
+    seqlock_init(&dev->lock);
+    init_waitqueue_head(&dev->vsync_wait);
+    INIT_KFIFO(dev->updates);
+    mutex_init(&dev->write_lock);
 
-    // Get register resource from device tree
-    ret = of_address_to_resource(pdev->dev.of_node, 0, &dev.res);
+    // The first instance keeps the plain /dev/vga_ball name
+    dev->id = ida_simple_get(&vga_ball_ida, 0, 0, GFP_KERNEL);
+    if (dev->id < 0) {
+        return dev->id;
+    }
+    ret = devm_add_action_or_reset(&pdev->dev, vga_ball_ida_remove, dev);
     if (ret) {
-        ret = -ENOENT;
-        goto fail_register;
+        return ret;
     }
+    if (dev->id == 0)
+        snprintf(dev->name, sizeof(dev->name), DRIVER_NAME);
+    else
+        snprintf(dev->name, sizeof(dev->name), DRIVER_NAME "%d", dev->id);
 
-    // Request memory region for our device
-    if (request_mem_region(dev.res.start, resource_size(&dev.res), DRIVER_NAME) == NULL) {
-        ret = -EBUSY;
-        goto fail_register;
+    // Register window from the device tree, requested and mapped
+    res = platform_get_resource(pdev, IORESOURCE_MEM, 0);
+    if (res == NULL) {
+        return -ENOENT;
+    }
+    dev->res = *res;
+    dev->virtbase = devm_ioremap_resource(&pdev->dev, res);
+    if (IS_ERR(dev->virtbase)) {
+        return PTR_ERR(dev->virtbase);
     }
 
-    // I/O map the memory region for register access
-    dev.virtbase = of_iomap(pdev->dev.of_node, 0);
-    if (dev.virtbase == NULL) {
-        ret = -ENOMEM;
-        goto fail_mem_region;
+    // Optional bridge clock, gated while the device is idle
+    dev->clk = devm_clk_get(&pdev->dev, NULL);
+    if (IS_ERR(dev->clk)) {
+        if (PTR_ERR(dev->clk) != -ENOENT) {
+            return PTR_ERR(dev->clk);
+        }
+        dev->clk = NULL;  // none in the device tree; the clk calls take NULL
     }
 
-    // Initialize background color and ball position
-    write_background(&beige);      // set initial background color
-    dev.position.xcoor = 320;      
-    dev.position.ycoor = 240;      // set initial ball position to center (matches hardware reset)
+    // Optional hardware features, from the device tree and the size of the
+    // register window
+    if (of_property_read_bool(pdev->dev.of_node, "csee4840,packed-regs"))
+        dev->caps |= VGA_BALL_CAP_PACKED;
+    if (of_property_read_bool(pdev->dev.of_node, "csee4840,timing-regs"))
+        dev->caps |= VGA_BALL_CAP_TIMING;
+    if (resource_size(&dev->res) >= VGA_BALL_REG_SPRITES_END)
+        dev->caps |= VGA_BALL_CAP_SPRITES;
+    if (resource_size(&dev->res) >= VGA_BALL_REG_PALETTE_END)
+        dev->caps |= VGA_BALL_CAP_PALETTE;
+    if (resource_size(&dev->res) >= VGA_BALL_REG_TILES_END)
+        dev->caps |= VGA_BALL_CAP_TILEMAP;
+    if (resource_size(&dev->res) >= VGA_BALL_REG_PATTERNS_END)
+        dev->caps |= VGA_BALL_CAP_PATTERNS;
+
+    // Command ring and upload staging buffer, zeroed and mappable by
+    // userspace; freed with the device, as mappings of them can outlive
+    // remove
+    dev->ring = vmalloc_user(sizeof(vga_ball_ring_t));
+    dev->staging = vmalloc_user(VGA_BALL_STAGING_SIZE);
+    if (dev->ring == NULL || dev->staging == NULL) {
+        return -ENOMEM;
+    }
 
-    pr_info(DRIVER_NAME ": device initialized\n");
+    ret = clk_prepare_enable(dev->clk);
+    if (ret) {
+        return ret;
+    }
+
+    // Initialize background color and ball position; no vblank source is
+    // running yet, so commit them to hardware directly
+    dev->background = beige;        // set initial background color
+    dev->position.xcoor = 320;      
+    dev->position.ycoor = 240;      // set initial ball position to center (matches hardware reset)
+    replay_shadow(dev);
+
+    // Vblank source: the device-tree interrupt if there is one, else a timer
+    ret = platform_get_irq(pdev, 0);
+    if (ret == -EPROBE_DEFER) {
+        goto fail_irq;
+    }
+    dev->irq = ret > 0 ? ret : 0;
+    if (dev->irq) {
+        // Requested disabled: vblank_start() enables it once we are powered
+        irq_set_status_flags(dev->irq, IRQ_NOAUTOEN);
+        ret = devm_request_irq(&pdev->dev, dev->irq, vga_ball_irq, 0, dev->name, dev);
+        if (ret) {
+            dev_err(&pdev->dev, "could not request irq %u\n", dev->irq);
+            goto fail_irq;
+        }
+        dev->caps |= VGA_BALL_CAP_VSYNC_IRQ;
+    } else {
+        hrtimer_init(&dev->vsync_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+        dev->vsync_timer.function = vga_ball_vsync_timer;
+        dev_info(&pdev->dev, "no vblank irq, using a %ld ns timer\n", VSYNC_PERIOD_NS);
+    }
+
+    // Powered now; held until probe is done, then idles once nothing is open
+    platform_set_drvdata(pdev, dev);
+    pm_runtime_get_noresume(&pdev->dev);
+    pm_runtime_set_active(&pdev->dev);
+    pm_runtime_set_autosuspend_delay(&pdev->dev, AUTOSUSPEND_MS);
+    pm_runtime_use_autosuspend(&pdev->dev);
+    pm_runtime_enable(&pdev->dev);
+    vblank_start(dev);
+
+    debug_init(dev);
+
+    // Register the misc device last: it can be opened as soon as it exists
+    dev->misc.minor = MISC_DYNAMIC_MINOR;
+    dev->misc.name = dev->name;
+    dev->misc.fops = &vga_ball_fops;
+    dev->misc.parent = &pdev->dev;
+    ret = misc_register(&dev->misc);
+    if (ret) {
+        dev_err(&pdev->dev, "misc device registration failed\n");
+        goto fail_register;
+    }
+
+    dev_info(&pdev->dev, "initialized as /dev/%s\n", dev->name);
+    pm_runtime_mark_last_busy(&pdev->dev);
+    pm_runtime_put_autosuspend(&pdev->dev);
     return 0;
 
-    // Error handling and cleanup:
-fail_mem_region:
-    release_mem_region(dev.res.start, resource_size(&dev.res));
+    // Error handling and cleanup; devm releases the rest
 fail_register:
-    misc_deregister(&vga_ball_misc_device);
+    debug_exit(dev);
+    pm_runtime_disable(&pdev->dev);
+    pm_runtime_dont_use_autosuspend(&pdev->dev);
+    pm_runtime_put_noidle(&pdev->dev);
+    pm_runtime_set_suspended(&pdev->dev);
+    vblank_stop(dev);
+fail_irq:
+    clk_disable_unprepare(dev->clk);
     return ret;
 }
 
-/* Remove function: called when the device is removed/unloaded */
+/*
+ * Remove function: called on unbind as well as unload.  Files still open
+ * keep the device state, but find the device gone: their calls fail with
+ * -ENODEV and their mappings are taken away.  The last close frees it.
+ */
 static int vga_ball_remove(struct platform_device *pdev) {
-    iounmap(dev.virtbase);
-    release_mem_region(dev.res.start, resource_size(&dev.res));
-    misc_deregister(&vga_ball_misc_device);
+    struct vga_ball_dev *dev = platform_get_drvdata(pdev);
+    struct vga_ball_file *vf;
+
+    misc_deregister(&dev->misc);
+
+    // Waiters for a vblank or queue space give up rather than hold us up
+    WRITE_ONCE(dev->dead, true);
+    wake_up_interruptible_all(&dev->vsync_wait);
+    down_write(&dev->remove_lock);
+    mutex_lock(&dev->files_lock);
+    list_for_each_entry(vf, &dev->files, node)
+        unmap_mapping_range(vf->mapping, 0, 0, 1);
+    mutex_unlock(&dev->files_lock);
+    up_write(&dev->remove_lock);
+
+    debug_exit(dev);
+
+    // Power up if idle so the vblank source can be stopped, then gate it for good
+    pm_runtime_get_sync(&pdev->dev);
+    pm_runtime_disable(&pdev->dev);
+    pm_runtime_dont_use_autosuspend(&pdev->dev);
+    pm_runtime_put_noidle(&pdev->dev);
+    pm_runtime_set_suspended(&pdev->dev);
+    vblank_stop(dev);
+    clk_disable_unprepare(dev->clk);
     return 0;
 }
 
@@ -172,24 +1576,13 @@ static struct platform_driver vga_ball_driver = {
         .name           = DRIVER_NAME,
         .owner          = THIS_MODULE,
         .of_match_table = of_match_ptr(vga_ball_of_match),
+        .pm             = &vga_ball_pm_ops,
     },
     .probe  = vga_ball_probe,
-    .remove = __exit_p(vga_ball_remove),
+    .remove = vga_ball_remove,
 };
 
-/* Module initialization and exit */
-static int __init vga_ball_init(void) {
-    pr_info(DRIVER_NAME ": init\n");
-    return platform_driver_probe(&vga_ball_driver, vga_ball_probe);
-}
-
-static void __exit vga_ball_exit(void) {
-    platform_driver_unregister(&vga_ball_driver);
-    pr_info(DRIVER_NAME ": exit\n");
-}
-
-module_init(vga_ball_init);
-module_exit(vga_ball_exit);
+module_platform_driver(vga_ball_driver);
 
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Stephen A. Edwards, Columbia University");
@@ -8,6 +8,108 @@
 
 #include <linux/ioctl.h>
 
+/*
+ * Build configuration: the display core this is built for, and the game's
+ * jump.  Each is a compile-time constant that everything below is derived
+ * from, so a build for another core (e.g. -DVGA_BALL_WIDTH=800
+ * -DVGA_BALL_HEIGHT=608, for driver and programs alike) costs nothing at
+ * run time.  VGA_BALL_READ_CONFIG tells a program what the loaded driver
+ * was built for.
+ */
+#ifndef VGA_BALL_WIDTH
+#define VGA_BALL_WIDTH       640   /* visible pixels per line */
+#endif
+#ifndef VGA_BALL_HEIGHT
+#define VGA_BALL_HEIGHT      480   /* visible lines */
+#endif
+#ifndef VGA_BALL_SCANLINES
+#define VGA_BALL_SCANLINES   (VGA_BALL_HEIGHT + 45)  /* lines per frame, with vertical blanking */
+#endif
+#ifndef VGA_BALL_REFRESH_HZ
+#define VGA_BALL_REFRESH_HZ  60
+#endif
+#ifndef VGA_BALL_TILE_SIZE
+#define VGA_BALL_TILE_SIZE   32    /* tile and pattern width and height */
+#endif
+#ifndef VGA_BALL_TILEMAP_COLS
+#define VGA_BALL_TILEMAP_COLS 64   /* tilemap width in tiles, wider than the screen */
+#endif
+#ifndef VGA_BALL_JUMP_HEIGHT
+#define VGA_BALL_JUMP_HEIGHT 48    /* pixels, a full jump and a duck */
+#endif
+
+/* Register byte offsets within the device window (see also mmap()) */
+#define VGA_BALL_REG_XCOOR    0
+#define VGA_BALL_REG_YCOOR    4
+#define VGA_BALL_REG_BG_RED   8
+#define VGA_BALL_REG_BG_GREEN 12
+#define VGA_BALL_REG_BG_BLUE  16
+#define VGA_BALL_REG_IRQ_ACK  20  /* write to acknowledge a vblank interrupt */
+
+/* Packed registers, used instead of the ones above with VGA_BALL_CAP_PACKED */
+#define VGA_BALL_REG_POS_XY   24  /* VGA_BALL_PACK_XY(x, y) */
+#define VGA_BALL_REG_BG_RGB   28  /* VGA_BALL_PACK_RGB(r, g, b) */
+
+/* Tilemap layer, with VGA_BALL_CAP_TILEMAP */
+#define VGA_BALL_REG_SCROLL_X 32  /* pixels the tilemap is scrolled left, mod its width */
+
+/* Sprite patterns, with VGA_BALL_CAP_PATTERNS */
+#define VGA_BALL_REG_BALL_FRAME 36  /* pattern the ball is drawn with, centered on it */
+
+/* Palette, with VGA_BALL_CAP_PALETTE */
+#define VGA_BALL_REG_BG_INDEX 40  /* palette entry for the background, 0 to use BG_RED.. */
+
+/* Read-only scan-out position, with VGA_BALL_CAP_TIMING */
+#define VGA_BALL_REG_FRAME_COUNT 44  /* frames scanned out since reset */
+#define VGA_BALL_REG_SCANLINE    48  /* line being scanned out, 0 .. VGA_BALL_SCANLINES - 1 */
+
+#define VGA_BALL_VISIBLE_LINES VGA_BALL_HEIGHT  /* on screen, then vblank */
+
+#define VGA_BALL_PACK_XY(x, y) \
+  (((unsigned int)(y) & 0xffff) << 16 | ((unsigned int)(x) & 0xffff))
+#define VGA_BALL_PACK_RGB(r, g, b) \
+  ((unsigned int)(r) << 16 | (unsigned int)(g) << 8 | (unsigned int)(b))
+
+/* Sprite attribute table, present when the register window is big enough */
+#define VGA_BALL_MAX_SPRITES 32
+#define VGA_BALL_REG_SPRITES 0x100
+#define VGA_BALL_REG_SPRITE_POS(i)  (VGA_BALL_REG_SPRITES + 8 * (i))     /* y << 16 | x */
+#define VGA_BALL_REG_SPRITE_ATTR(i) (VGA_BALL_REG_SPRITES + 8 * (i) + 4) /* flags << 8 | tile */
+#define VGA_BALL_REG_SPRITES_END    (VGA_BALL_REG_SPRITES + 8 * VGA_BALL_MAX_SPRITES)
+
+/*
+ * Color lookup table for every color index in tiles and patterns, and for
+ * the background through BG_INDEX: one VGA_BALL_PACK_RGB word per entry.
+ */
+#define VGA_BALL_PALETTE_SIZE  256
+#define VGA_BALL_REG_PALETTE   0x400
+#define VGA_BALL_REG_PALETTE_ENTRY(i) (VGA_BALL_REG_PALETTE + 4 * (i))
+#define VGA_BALL_REG_PALETTE_END      (VGA_BALL_REG_PALETTE + 4 * VGA_BALL_PALETTE_SIZE)
+
+/*
+ * Tilemap layer memory, written with VGA_BALL_UPLOAD.  The map is one tile
+ * index byte per cell, row by row; it is wider than the screen and wraps
+ * around as it scrolls.  Tile patterns are VGA_BALL_TILE_SIZE pixels square,
+ * one color index byte each, row by row; index 0 is transparent.
+ */
+#define VGA_BALL_TILEMAP_ROWS  (VGA_BALL_HEIGHT / VGA_BALL_TILE_SIZE)
+#define VGA_BALL_MAX_TILES     32
+#define VGA_BALL_REG_TILEMAP     0x1000
+#define VGA_BALL_REG_TILEMAP_END (VGA_BALL_REG_TILEMAP + VGA_BALL_TILEMAP_COLS * VGA_BALL_TILEMAP_ROWS)
+#define VGA_BALL_REG_TILES       0x8000
+#define VGA_BALL_TILE_BYTES      (VGA_BALL_TILE_SIZE * VGA_BALL_TILE_SIZE)
+#define VGA_BALL_REG_TILES_END   (VGA_BALL_REG_TILES + VGA_BALL_TILE_BYTES * VGA_BALL_MAX_TILES)
+
+/*
+ * Sprite pattern memory, written with VGA_BALL_UPLOAD: square patterns of
+ * color index bytes, like tile patterns.  A sprite's tile field and
+ * the ball's frame register pick a pattern, so changing an animation
+ * frame is one register write.
+ */
+#define VGA_BALL_MAX_PATTERNS     64
+#define VGA_BALL_REG_PATTERNS     VGA_BALL_REG_TILES_END  /* 0x10000 with 32 pixel tiles */
+#define VGA_BALL_REG_PATTERNS_END (VGA_BALL_REG_PATTERNS + VGA_BALL_TILE_BYTES * VGA_BALL_MAX_PATTERNS)
+
 typedef struct {
   unsigned char red, green, blue;
 } vga_ball_color_t;
@@ -21,12 +123,237 @@ typedef struct {
   vga_ball_color_t background;
 } vga_ball_arg_t;
 
+/* Capabilities of the probed hardware, from VGA_BALL_READ_CAPS */
+#define VGA_BALL_CAP_PACKED    (1 << 0)  /* one word each for position and color */
+#define VGA_BALL_CAP_SPRITES   (1 << 1)  /* sprite attribute table */
+#define VGA_BALL_CAP_VSYNC_IRQ (1 << 2)  /* vblank comes from hardware, not a timer */
+#define VGA_BALL_CAP_TILEMAP   (1 << 3)  /* scrolling tilemap layer */
+#define VGA_BALL_CAP_PATTERNS  (1 << 4)  /* uploadable sprite patterns */
+#define VGA_BALL_CAP_PALETTE   (1 << 5)  /* color lookup table */
+#define VGA_BALL_CAP_TIMING    (1 << 6)  /* frame counter and scanline registers */
+
+/* Dirty-mask bits for vga_ball_frame_t: which registers to commit */
+#define VGA_BALL_DIRTY_X     (1 << 0)
+#define VGA_BALL_DIRTY_Y     (1 << 1)
+#define VGA_BALL_DIRTY_RED   (1 << 2)
+#define VGA_BALL_DIRTY_GREEN (1 << 3)
+#define VGA_BALL_DIRTY_BLUE  (1 << 4)
+
+#define VGA_BALL_DIRTY_POS   (VGA_BALL_DIRTY_X | VGA_BALL_DIRTY_Y)
+#define VGA_BALL_DIRTY_BG    (VGA_BALL_DIRTY_RED | VGA_BALL_DIRTY_GREEN | \
+                              VGA_BALL_DIRTY_BLUE)
+#define VGA_BALL_DIRTY_ALL   (VGA_BALL_DIRTY_POS | VGA_BALL_DIRTY_BG)
+
+/* Registers of optional features, which the ring does not carry */
+#define VGA_BALL_DIRTY_SCROLL     (1 << 5)  /* with VGA_BALL_CAP_TILEMAP */
+#define VGA_BALL_DIRTY_BALL_FRAME (1 << 6)  /* with VGA_BALL_CAP_PATTERNS */
+#define VGA_BALL_DIRTY_BG_INDEX   (1 << 7)  /* with VGA_BALL_CAP_PALETTE */
+#define VGA_BALL_DIRTY_FRAME      (VGA_BALL_DIRTY_ALL | VGA_BALL_DIRTY_SCROLL | \
+                                   VGA_BALL_DIRTY_BALL_FRAME | VGA_BALL_DIRTY_BG_INDEX)
+
+/* Registers committed together; only dirty fields are used */
+typedef struct {
+  vga_ball_pos_t position;
+  vga_ball_color_t background;
+  unsigned int scroll_x;
+  unsigned int ball_frame;
+  unsigned int bg_index;
+  unsigned int dirty;
+} vga_ball_frame_t;
+
+/* Sprite flags */
+#define VGA_BALL_SPRITE_ENABLE (1 << 0)
+#define VGA_BALL_SPRITE_HFLIP  (1 << 1)
+#define VGA_BALL_SPRITE_VFLIP  (1 << 2)
+
+typedef struct {
+  short xcoor, ycoor;  /* top-left corner; may be off screen */
+  unsigned char tile;
+  unsigned char flags; /* VGA_BALL_SPRITE_* */
+} vga_ball_sprite_t;
+
+/* Sprite table entries first .. first + count - 1, from sprites[0] on */
+typedef struct {
+  unsigned int first, count;
+  vga_ball_sprite_t sprites[VGA_BALL_MAX_SPRITES];
+} vga_ball_sprites_t;
+
+/*
+ * Palette entries first .. first + count - 1, from colors[0] on, committed
+ * together at the next vblank
+ */
+typedef struct {
+  unsigned int first, count;
+  unsigned int colors[VGA_BALL_PALETTE_SIZE];  /* VGA_BALL_PACK_RGB(r, g, b) */
+} vga_ball_palette_t;
+
+/*
+ * When the last vblank happened and where scan-out is now, from
+ * VGA_BALL_READ_TIMING.  Times are CLOCK_MONOTONIC nanoseconds; the
+ * hardware fields are 0 without VGA_BALL_CAP_TIMING.
+ */
+typedef struct {
+  unsigned int frame;            /* driver vblank count, as read() returns */
+  unsigned int hw_frame;         /* hardware frame counter at that vblank */
+  unsigned long long vblank_ns;  /* when the driver handled that vblank */
+  unsigned int hw_frame_now;     /* hardware frame counter now */
+  unsigned int scanline;         /* line being scanned out now */
+  unsigned long long now_ns;     /* when the two were read */
+} vga_ball_timing_t;
+
+/*
+ * What the driver was built for, from VGA_BALL_READ_CONFIG; a program
+ * built for the same display gets VGA_BALL_CONFIG_INIT.  Register offsets
+ * past the fixed ones at the start depend on these.
+ */
+typedef struct {
+  unsigned int width, height;    /* VGA_BALL_WIDTH, VGA_BALL_HEIGHT */
+  unsigned int scanlines;        /* VGA_BALL_SCANLINES */
+  unsigned int refresh_hz;       /* VGA_BALL_REFRESH_HZ */
+  unsigned int tile_size;        /* VGA_BALL_TILE_SIZE */
+  unsigned int tilemap_cols, tilemap_rows;
+  unsigned int window;           /* register window bytes for every capability */
+} vga_ball_config_t;
+
+#define VGA_BALL_CONFIG_INIT { \
+  VGA_BALL_WIDTH, VGA_BALL_HEIGHT, VGA_BALL_SCANLINES, VGA_BALL_REFRESH_HZ, \
+  VGA_BALL_TILE_SIZE, VGA_BALL_TILEMAP_COLS, VGA_BALL_TILEMAP_ROWS, \
+  VGA_BALL_REG_PATTERNS_END }
+
+/* Register writes done and skipped because hardware already held the value */
+typedef struct {
+  unsigned long long mmio_writes;
+  unsigned long long mmio_elided;
+} vga_ball_stats_t;
+
+/* Byte offset to pass to mmap() for the command ring instead of registers */
+#define VGA_BALL_MMAP_RING 0x100000
+
+#define VGA_BALL_RING_SIZE 256  /* entries, a power of two */
+
+/* A queued update, applied at the vblank that brings the count to frame */
+typedef struct {
+  unsigned int frame;
+  unsigned int dirty;  /* VGA_BALL_DIRTY_* fields to apply */
+  vga_ball_pos_t position;
+  vga_ball_color_t background;
+} vga_ball_cmd_t;
+
+/*
+ * Single-producer/single-consumer command ring shared with the driver.
+ * Userspace fills cmds[head % VGA_BALL_RING_SIZE] and then advances head;
+ * the driver applies at most one due entry per vblank and advances tail.
+ * frame mirrors the driver's vblank count.  Only one open file at a time
+ * may map the ring.
+ */
+typedef struct {
+  unsigned int head;
+  unsigned int tail;
+  unsigned int frame;
+  unsigned int reserved;
+  vga_ball_cmd_t cmds[VGA_BALL_RING_SIZE];
+} vga_ball_ring_t;
+
+/*
+ * write() takes a stream of update records, queued in the driver and
+ * applied at the next vblank.  Records for the same field in one frame
+ * collapse to the last one, since only the final value is committed.
+ * Field n is the field of dirty bit n, so VGA_BALL_DIRTY_X is
+ * 1 << VGA_BALL_FIELD_X.  A full queue blocks the writer until the next
+ * vblank, or fails with EAGAIN under O_NONBLOCK; poll() reports POLLOUT
+ * while there is room.
+ */
+#define VGA_BALL_FIELD_X          0
+#define VGA_BALL_FIELD_Y          1
+#define VGA_BALL_FIELD_RED        2
+#define VGA_BALL_FIELD_GREEN      3
+#define VGA_BALL_FIELD_BLUE       4
+#define VGA_BALL_FIELD_SCROLL     5  /* with VGA_BALL_CAP_TILEMAP */
+#define VGA_BALL_FIELD_BALL_FRAME 6  /* with VGA_BALL_CAP_PATTERNS */
+#define VGA_BALL_FIELD_BG_INDEX   7  /* with VGA_BALL_CAP_PALETTE */
+#define VGA_BALL_NFIELDS          8
+
+#define VGA_BALL_UPDATE_QUEUE 256  /* records, a power of two */
+
+typedef struct {
+  unsigned int field;  /* VGA_BALL_FIELD_* */
+  unsigned int value;
+} vga_ball_update_t;
+
+/*
+ * Byte offset to pass to mmap() for the upload staging buffer.  Fill it,
+ * then VGA_BALL_UPLOAD copies len bytes from src in the buffer to offset
+ * in the register window in one burst.  Uploads are not held for vblank:
+ * change what isn't on screen, or wait for a vblank first.  One open file
+ * at a time owns the buffer, the first to map it; others get EBUSY from
+ * mmap() and VGA_BALL_UPLOAD until it is closed.
+ */
+#define VGA_BALL_MMAP_STAGING 0x200000
+#define VGA_BALL_STAGING_SIZE 0x10000
+
+typedef struct {
+  unsigned int offset;  /* register window byte offset, e.g. VGA_BALL_REG_TILES */
+  unsigned int src;     /* byte offset in the staging buffer */
+  unsigned int len;     /* bytes; all three are multiples of 4 */
+} vga_ball_upload_t;
+
+#define VGA_BALL_MAX_KEYFRAMES 16
+
+/* Easing applied on the way from the previous keyframe to this one */
+#define VGA_BALL_EASE_LINEAR 0
+#define VGA_BALL_EASE_IN     1  /* quadratic, starts slow */
+#define VGA_BALL_EASE_OUT    2  /* quadratic, ends slow */
+#define VGA_BALL_EASE_IN_OUT 3  /* smoothstep */
+
+/* Keyframe positions are Q16.16 fixed point */
+#define VGA_BALL_FIX(n) ((n) * 65536)
+
+typedef struct {
+  int xcoor, ycoor;     /* Q16.16 position to reach */
+  unsigned int frames;  /* vblanks from the previous keyframe, at most 65535 */
+  unsigned int ease;    /* VGA_BALL_EASE_* */
+} vga_ball_keyframe_t;
+
+/* After the last keyframe, go on to keys[0] again */
+#define VGA_BALL_ANIM_LOOP (1 << 0)
+
+/*
+ * Keyframe animation run by the driver at vblank, starting from the ball's
+ * position when it is submitted.  While it runs it overrides position
+ * writes; submitting one with count 0 stops the current animation.
+ */
+typedef struct {
+  unsigned int count;
+  unsigned int flags;   /* VGA_BALL_ANIM_* */
+  vga_ball_keyframe_t keys[VGA_BALL_MAX_KEYFRAMES];
+} vga_ball_anim_t;
+
 #define VGA_BALL_MAGIC 'q'
 
-/* ioctls and their arguments */
+/*
+ * ioctls and their arguments.  Writes update the driver's shadow registers,
+ * which are committed to hardware together at the next vblank.
+ */
 #define VGA_BALL_WRITE_BACKGROUND _IOW(VGA_BALL_MAGIC, 1, vga_ball_arg_t)
 #define VGA_BALL_READ_BACKGROUND  _IOR(VGA_BALL_MAGIC, 2, vga_ball_arg_t)
 #define VGA_BALL_WRITE_POS _IOW(VGA_BALL_MAGIC, 3, vga_ball_arg_t)
 #define VGA_BALL_READ_POS _IOR(VGA_BALL_MAGIC, 4, vga_ball_arg_t)
+#define VGA_BALL_WRITE_FRAME _IOW(VGA_BALL_MAGIC, 5, vga_ball_frame_t)
+#define VGA_BALL_WAIT_VSYNC _IOR(VGA_BALL_MAGIC, 6, unsigned int)
+#define VGA_BALL_ANIMATE _IOW(VGA_BALL_MAGIC, 7, vga_ball_anim_t)
+#define VGA_BALL_WRITE_SPRITES _IOW(VGA_BALL_MAGIC, 8, vga_ball_sprites_t)
+#define VGA_BALL_READ_STATS _IOR(VGA_BALL_MAGIC, 9, vga_ball_stats_t)
+#define VGA_BALL_READ_CAPS _IOR(VGA_BALL_MAGIC, 10, unsigned int)
+#define VGA_BALL_UPLOAD _IOW(VGA_BALL_MAGIC, 11, vga_ball_upload_t)
+#define VGA_BALL_WRITE_PALETTE _IOW(VGA_BALL_MAGIC, 12, vga_ball_palette_t)
+#define VGA_BALL_READ_TIMING _IOR(VGA_BALL_MAGIC, 13, vga_ball_timing_t)
+#define VGA_BALL_READ_CONFIG _IOR(VGA_BALL_MAGIC, 14, vga_ball_config_t)
+
+/*
+ * read() returns the vblank frame count as an unsigned int, blocking until
+ * a vblank this file has not seen yet; poll() reports POLLIN when one is
+ * pending.  VGA_BALL_WAIT_VSYNC always waits for the next vblank.  write()
+ * takes vga_ball_update_t records, described above.
+ */
 
 #endif
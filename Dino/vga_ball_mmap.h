@@ -0,0 +1,143 @@
+/*
+ * Userspace helpers for mmap() of /dev/vga_ball: writing the registers
+ * directly, and queueing commands on the driver's command ring, with no
+ * system call per update; and filling the staging buffer for uploads.
+ *
+ * Direct register writes are not seen by VGA_BALL_READ_POS or
+ * VGA_BALL_READ_BACKGROUND.
+ */
+
+#ifndef _VGA_BALL_MMAP_H
+#define _VGA_BALL_MMAP_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include "vga_ball.h"
+
+typedef struct {
+  volatile uint32_t *regs;  /* start of the register window */
+  size_t len;               /* length of the mapping */
+  unsigned int caps;        /* VGA_BALL_CAP_*, picks the register layout */
+} vga_ball_mmio_t;
+
+/* Access the 32-bit register at byte offset off */
+#define VGA_BALL_MMIO_REG(m, off) ((m)->regs[(off) / 4])
+
+/* Map the register window of an open /dev/vga_ball; returns 0 or -1 */
+static inline int vga_ball_mmio_open(vga_ball_mmio_t *m, int fd)
+{
+  void *p;
+
+  if (ioctl(fd, VGA_BALL_READ_CAPS, &m->caps) < 0)
+    m->caps = 0;
+  m->len = sysconf(_SC_PAGESIZE);
+  p = mmap(NULL, m->len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (p == MAP_FAILED) {
+    m->regs = NULL;
+    return -1;
+  }
+  m->regs = (volatile uint32_t *)p;
+  return 0;
+}
+
+static inline void vga_ball_mmio_close(vga_ball_mmio_t *m)
+{
+  if (m->regs)
+    munmap((void *)m->regs, m->len);
+  m->regs = NULL;
+}
+
+static inline void vga_ball_mmio_write_pos(vga_ball_mmio_t *m,
+                                           const vga_ball_pos_t *pos)
+{
+  if (m->caps & VGA_BALL_CAP_PACKED) {
+    VGA_BALL_MMIO_REG(m, VGA_BALL_REG_POS_XY) =
+      VGA_BALL_PACK_XY(pos->xcoor, pos->ycoor);
+  } else {
+    VGA_BALL_MMIO_REG(m, VGA_BALL_REG_XCOOR) = pos->xcoor;
+    VGA_BALL_MMIO_REG(m, VGA_BALL_REG_YCOOR) = pos->ycoor;
+  }
+}
+
+static inline void vga_ball_mmio_write_background(vga_ball_mmio_t *m,
+                                                  const vga_ball_color_t *c)
+{
+  if (m->caps & VGA_BALL_CAP_PACKED) {
+    VGA_BALL_MMIO_REG(m, VGA_BALL_REG_BG_RGB) =
+      VGA_BALL_PACK_RGB(c->red, c->green, c->blue);
+  } else {
+    VGA_BALL_MMIO_REG(m, VGA_BALL_REG_BG_RED)   = c->red;
+    VGA_BALL_MMIO_REG(m, VGA_BALL_REG_BG_GREEN) = c->green;
+    VGA_BALL_MMIO_REG(m, VGA_BALL_REG_BG_BLUE)  = c->blue;
+  }
+}
+
+/* Scan-out position, straight from the registers, with VGA_BALL_CAP_TIMING */
+static inline unsigned int vga_ball_mmio_frame_count(const vga_ball_mmio_t *m)
+{
+  return VGA_BALL_MMIO_REG(m, VGA_BALL_REG_FRAME_COUNT);
+}
+
+static inline unsigned int vga_ball_mmio_scanline(const vga_ball_mmio_t *m)
+{
+  return VGA_BALL_MMIO_REG(m, VGA_BALL_REG_SCANLINE);
+}
+
+/* Map the command ring of an open /dev/vga_ball; returns NULL on failure */
+static inline vga_ball_ring_t *vga_ball_ring_map(int fd)
+{
+  void *p = mmap(NULL, sizeof(vga_ball_ring_t), PROT_READ | PROT_WRITE,
+                 MAP_SHARED, fd, VGA_BALL_MMAP_RING);
+  return p == MAP_FAILED ? NULL : (vga_ball_ring_t *)p;
+}
+
+static inline void vga_ball_ring_unmap(vga_ball_ring_t *ring)
+{
+  munmap(ring, sizeof(vga_ball_ring_t));
+}
+
+/* Queue a command; returns 0, or -1 if the ring is full */
+static inline int vga_ball_ring_push(vga_ball_ring_t *ring,
+                                     const vga_ball_cmd_t *cmd)
+{
+  unsigned int head = ring->head;
+  unsigned int tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+
+  if (head - tail >= VGA_BALL_RING_SIZE)
+    return -1;
+  ring->cmds[head & (VGA_BALL_RING_SIZE - 1)] = *cmd;
+  __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+  return 0;
+}
+
+/* The driver's vblank count, for computing vga_ball_cmd_t.frame */
+static inline unsigned int vga_ball_ring_frame(const vga_ball_ring_t *ring)
+{
+  return __atomic_load_n(&ring->frame, __ATOMIC_RELAXED);
+}
+
+/* Map the upload staging buffer of an open /dev/vga_ball; NULL on failure */
+static inline void *vga_ball_staging_map(int fd)
+{
+  void *p = mmap(NULL, VGA_BALL_STAGING_SIZE, PROT_READ | PROT_WRITE,
+                 MAP_SHARED, fd, VGA_BALL_MMAP_STAGING);
+  return p == MAP_FAILED ? NULL : p;
+}
+
+static inline void vga_ball_staging_unmap(void *staging)
+{
+  munmap(staging, VGA_BALL_STAGING_SIZE);
+}
+
+/* Copy len bytes at src in the staging buffer to offset; returns 0 or -1 */
+static inline int vga_ball_upload(int fd, unsigned int offset,
+                                  unsigned int src, unsigned int len)
+{
+  vga_ball_upload_t up = { offset, src, len };
+  return ioctl(fd, VGA_BALL_UPLOAD, &up);
+}
+
+#endif
@@ -0,0 +1,530 @@
+/*
+ * libvgaball: the backends, and picking one
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include "vgaball.h"
+#include "sim.h"
+
+struct vgaball_backend {
+    const char *name;
+    int device;              // 1: needs the device, opened before open() is called
+    int (*open)(struct vgaball *vb);    // optional
+    void (*close)(struct vgaball *vb);  // optional
+    int (*frame)(struct vgaball *vb, const vga_ball_frame_t *frame);
+    int (*sprites)(struct vgaball *vb, const vga_ball_sprites_t *sprites);
+    int (*palette)(struct vgaball *vb, const vga_ball_palette_t *pal);
+    void *(*staging)(struct vgaball *vb);
+    int (*upload)(struct vgaball *vb, const vga_ball_upload_t *up);
+    int (*present)(struct vgaball *vb);  // optional
+};
+
+/* The fields past position and background */
+#define EXTRA_FIELDS (VGA_BALL_DIRTY_FRAME & ~VGA_BALL_DIRTY_ALL)
+
+/* What the device backends share: everything but the frame path */
+
+static int dev_sprites(struct vgaball *vb, const vga_ball_sprites_t *sprites) {
+    return ioctl(vb->fd, VGA_BALL_WRITE_SPRITES, sprites);
+}
+
+static int dev_palette(struct vgaball *vb, const vga_ball_palette_t *pal) {
+    return ioctl(vb->fd, VGA_BALL_WRITE_PALETTE, pal);
+}
+
+static void *dev_staging(struct vgaball *vb) {
+    return vga_ball_staging_map(vb->fd);
+}
+
+static int dev_upload(struct vgaball *vb, const vga_ball_upload_t *up) {
+    return ioctl(vb->fd, VGA_BALL_UPLOAD, up);
+}
+
+/* Fields with no path of their own in a backend go in one WRITE_FRAME */
+static int frame_extra(struct vgaball *vb, const vga_ball_frame_t *frame) {
+    vga_ball_frame_t rest;
+
+    if (!(frame->dirty & EXTRA_FIELDS)) {
+        return 0;
+    }
+    rest = *frame;
+    rest.dirty &= EXTRA_FIELDS;
+    return ioctl(vb->fd, VGA_BALL_WRITE_FRAME, &rest);
+}
+
+/* ioctl: a call for the position and one for the background */
+static int ioctl_frame(struct vgaball *vb, const vga_ball_frame_t *frame) {
+    vga_ball_arg_t arg;
+
+    if ((frame->dirty & VGA_BALL_DIRTY_POS) &&
+        ioctl(vb->fd, VGA_BALL_WRITE_POS, &frame->position) < 0) {
+        return -1;
+    }
+    if (frame->dirty & VGA_BALL_DIRTY_BG) {
+        arg.background = frame->background;
+        if (ioctl(vb->fd, VGA_BALL_WRITE_BACKGROUND, &arg) < 0) {
+            return -1;
+        }
+    }
+    return frame_extra(vb, frame);
+}
+
+/* frame: all of it in one VGA_BALL_WRITE_FRAME */
+static int frame_frame(struct vgaball *vb, const vga_ball_frame_t *frame) {
+    return ioctl(vb->fd, VGA_BALL_WRITE_FRAME, frame);
+}
+
+/* write: one vga_ball_update_t per field */
+static int write_frame(struct vgaball *vb, const vga_ball_frame_t *frame) {
+    vga_ball_update_t rec[VGA_BALL_NFIELDS];
+    ssize_t len;
+    int n = 0;
+
+    for (unsigned int f = 0; f < VGA_BALL_NFIELDS; f++) {
+        if (frame->dirty & (1u << f)) {
+            rec[n].field = f;
+            rec[n].value = vgaball_get_field(frame, f);
+            n++;
+        }
+    }
+    if (n == 0) {
+        return 0;
+    }
+    len = write(vb->fd, rec, n * sizeof(rec[0]));
+    if (len < 0) {
+        return -1;
+    }
+    if (len != (ssize_t)(n * sizeof(rec[0]))) {
+        errno = EAGAIN;  // the queue filled part way through
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * ring: position and background as a command due at the next vblank.  The
+ * ring carries nothing else, so the other fields take a WRITE_FRAME; they
+ * can land a frame early if the ring is backed up.
+ */
+static int ring_open(struct vgaball *vb) {
+    vb->ring = vga_ball_ring_map(vb->fd);
+    return vb->ring ? 0 : -1;
+}
+
+static void ring_close(struct vgaball *vb) {
+    vga_ball_ring_unmap(vb->ring);
+}
+
+static int ring_frame(struct vgaball *vb, const vga_ball_frame_t *frame) {
+    vga_ball_cmd_t cmd;
+
+    if (frame->dirty & VGA_BALL_DIRTY_ALL) {
+        cmd.frame = vga_ball_ring_frame(vb->ring);
+        cmd.dirty = frame->dirty & VGA_BALL_DIRTY_ALL;
+        cmd.position = frame->position;
+        cmd.background = frame->background;
+        if (vga_ball_ring_push(vb->ring, &cmd) < 0) {
+            errno = EAGAIN;
+            return -1;
+        }
+    }
+    return frame_extra(vb, frame);
+}
+
+/* mmap: straight to the registers, seen as soon as they are written */
+static const unsigned int field_regs[VGA_BALL_NFIELDS] = {
+    [VGA_BALL_FIELD_SCROLL]     = VGA_BALL_REG_SCROLL_X,
+    [VGA_BALL_FIELD_BALL_FRAME] = VGA_BALL_REG_BALL_FRAME,
+    [VGA_BALL_FIELD_BG_INDEX]   = VGA_BALL_REG_BG_INDEX,
+};
+
+static int mmap_open(struct vgaball *vb) {
+    return vga_ball_mmio_open(&vb->mmio, vb->fd);
+}
+
+static void mmap_close(struct vgaball *vb) {
+    vga_ball_mmio_close(&vb->mmio);
+}
+
+static int mmap_frame(struct vgaball *vb, const vga_ball_frame_t *frame) {
+    if (frame->dirty & VGA_BALL_DIRTY_POS) {
+        vga_ball_mmio_write_pos(&vb->mmio, &frame->position);
+    }
+    if (frame->dirty & VGA_BALL_DIRTY_BG) {
+        vga_ball_mmio_write_background(&vb->mmio, &frame->background);
+    }
+    for (unsigned int f = VGA_BALL_FIELD_SCROLL; f < VGA_BALL_NFIELDS; f++) {
+        if (frame->dirty & (1u << f)) {
+            VGA_BALL_MMIO_REG(&vb->mmio, field_regs[f]) = vgaball_get_field(frame, f);
+        }
+    }
+    return 0;
+}
+
+/*
+ * null: a device with everything but vblanks, which takes every update and
+ * shows none of them.  Updates are checked as the driver would.
+ */
+static int null_open(struct vgaball *vb) {
+    vb->caps = VGA_BALL_CAP_SPRITES | VGA_BALL_CAP_TILEMAP |
+               VGA_BALL_CAP_PATTERNS | VGA_BALL_CAP_PALETTE;
+    return 0;
+}
+
+static void null_close(struct vgaball *vb) {
+    free(vb->staging);
+}
+
+static int null_frame(struct vgaball *vb, const vga_ball_frame_t *frame) {
+    if (frame->dirty & ~VGA_BALL_DIRTY_FRAME) {
+        errno = EINVAL;
+        return -1;
+    }
+    return 0;
+}
+
+static int null_sprites(struct vgaball *vb, const vga_ball_sprites_t *sprites) {
+    if (sprites->first >= VGA_BALL_MAX_SPRITES ||
+        sprites->count > VGA_BALL_MAX_SPRITES - sprites->first) {
+        errno = EINVAL;
+        return -1;
+    }
+    return 0;
+}
+
+static int null_palette(struct vgaball *vb, const vga_ball_palette_t *pal) {
+    if (pal->first >= VGA_BALL_PALETTE_SIZE ||
+        pal->count > VGA_BALL_PALETTE_SIZE - pal->first) {
+        errno = EINVAL;
+        return -1;
+    }
+    return 0;
+}
+
+static void *null_staging(struct vgaball *vb) {
+    return calloc(1, VGA_BALL_STAGING_SIZE);
+}
+
+static int null_upload(struct vgaball *vb, const vga_ball_upload_t *up) {
+    if (((up->offset | up->src | up->len) & 3) ||
+        up->src > VGA_BALL_STAGING_SIZE || up->len > VGA_BALL_STAGING_SIZE - up->src) {
+        errno = EINVAL;
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * sim: no device either, but the updates land in a software model of the
+ * display, which renders a frame on each vgaball_present().  Frames go
+ * nowhere unless $VGABALL_SIM_PPM says where:
+ *
+ *   |command   piped to command's standard input, one PPM after another
+ *   name%d     a file per frame, numbered with the printf conversion, which
+ *              may have a width (%05d) but must be the only % in the name
+ *   name       one file, replaced with each frame
+ *
+ * and $VGABALL_SIM_EVERY renders only every Nth frame, or none with 0.
+ */
+struct sim_state {
+    struct sim sim;
+    const char *path;        // $VGABALL_SIM_PPM, or NULL
+    int numbered;            // path is a name%d format
+    FILE *pipe;              // open viewer, for a |command
+    unsigned long every;     // frames presented per frame rendered
+    unsigned long presented;
+};
+
+/* A format with one conversion, %d with digits between, and no other % */
+static int frame_format(const char *path) {
+    const char *p = strchr(path, '%');
+
+    if (p == NULL) {
+        return 0;
+    }
+    p += strspn(p + 1, "0123456789") + 1;
+    return *p == 'd' && strchr(p, '%') == NULL;
+}
+
+static int sim_open(struct vgaball *vb) {
+    struct sim_state *st;
+    const char *every = getenv(VGABALL_SIM_EVERY);
+
+    st = malloc(sizeof(*st));
+    if (st == NULL) {
+        return -1;
+    }
+    sim_init(&st->sim);
+    st->path = getenv(VGABALL_SIM_PPM);
+    st->numbered = st->path && frame_format(st->path);
+    st->pipe = NULL;
+    st->every = every ? strtoul(every, NULL, 0) : 1;
+    st->presented = 0;
+    if (st->path && st->path[0] == '|') {
+        st->pipe = popen(st->path + 1, "w");
+        if (st->pipe == NULL) {
+            free(st);
+            return -1;
+        }
+    }
+    vb->priv = st;
+    null_open(vb);
+    return 0;
+}
+
+static void sim_close(struct vgaball *vb) {
+    struct sim_state *st = vb->priv;
+
+    if (st->pipe) {
+        pclose(st->pipe);
+    }
+    free(st);
+    free(vb->staging);
+}
+
+static int sim_backend_frame(struct vgaball *vb, const vga_ball_frame_t *frame) {
+    return sim_frame(&((struct sim_state *)vb->priv)->sim, frame);
+}
+
+static int sim_backend_sprites(struct vgaball *vb, const vga_ball_sprites_t *sprites) {
+    return sim_sprites(&((struct sim_state *)vb->priv)->sim, sprites);
+}
+
+static int sim_backend_palette(struct vgaball *vb, const vga_ball_palette_t *pal) {
+    return sim_palette(&((struct sim_state *)vb->priv)->sim, pal);
+}
+
+static int sim_backend_upload(struct vgaball *vb, const vga_ball_upload_t *up) {
+    if (vb->staging == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+    return sim_upload(&((struct sim_state *)vb->priv)->sim, up, vb->staging);
+}
+
+/* Write a frame to a file, through a new name so readers never see half */
+static int sim_write_file(const struct sim *s, const char *path) {
+    char tmp[256];
+    FILE *f;
+    int ret;
+
+    if (snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int)sizeof(tmp)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    f = fopen(tmp, "wb");
+    if (f == NULL) {
+        return -1;
+    }
+    ret = sim_write_ppm(s, f);
+    if (fclose(f) != 0 || ret < 0) {
+        unlink(tmp);
+        return -1;
+    }
+    return rename(tmp, path);
+}
+
+static int sim_present(struct vgaball *vb) {
+    struct sim_state *st = vb->priv;
+    char name[256];
+
+    if (st->every == 0 || st->presented++ % st->every) {
+        return 0;
+    }
+    sim_render(&st->sim);
+    if (st->path == NULL) {
+        return 0;
+    }
+    if (st->pipe) {
+        return sim_write_ppm(&st->sim, st->pipe);
+    }
+    if (st->numbered) {
+        int n = snprintf(name, sizeof(name), st->path, (int)(st->sim.frames - 1));
+        if (n < 0 || n >= (int)sizeof(name)) {
+            errno = ENAMETOOLONG;
+            return -1;
+        }
+        return sim_write_file(&st->sim, name);
+    }
+    return sim_write_file(&st->sim, st->path);
+}
+
+static const struct vgaball_backend backend_table[] = {
+    { "ioctl", 1, NULL, NULL, ioctl_frame, dev_sprites, dev_palette, dev_staging, dev_upload, NULL },
+    { "frame", 1, NULL, NULL, frame_frame, dev_sprites, dev_palette, dev_staging, dev_upload, NULL },
+    { "write", 1, NULL, NULL, write_frame, dev_sprites, dev_palette, dev_staging, dev_upload, NULL },
+    { "ring",  1, ring_open, ring_close, ring_frame, dev_sprites, dev_palette, dev_staging, dev_upload, NULL },
+    { "mmap",  1, mmap_open, mmap_close, mmap_frame, dev_sprites, dev_palette, dev_staging, dev_upload, NULL },
+    { "null",  0, null_open, null_close, null_frame, null_sprites, null_palette, null_staging, null_upload, NULL },
+    { "sim",   0, sim_open, sim_close, sim_backend_frame, sim_backend_sprites, sim_backend_palette,
+      null_staging, sim_backend_upload, sim_present },
+};
+
+static const struct vgaball_backend *find_backend(const char *name) {
+    for (unsigned int i = 0; i < sizeof(backend_table) / sizeof(backend_table[0]); i++) {
+        if (!strcmp(backend_table[i].name, name)) {
+            return &backend_table[i];
+        }
+    }
+    return NULL;
+}
+
+/* Open one backend; returns 0, or -1 with errno set and vb closed */
+static int open_backend(struct vgaball *vb, const struct vgaball_backend *b, const char *device) {
+    memset(vb, 0, sizeof(*vb));
+    vb->backend = b;
+    vb->fd = -1;
+
+    if (b->device) {
+        vb->fd = open(device, O_RDWR);
+        if (vb->fd == -1) {
+            return -1;
+        }
+        if (ioctl(vb->fd, VGA_BALL_READ_CAPS, &vb->caps) < 0) {
+            vb->caps = 0;
+        }
+    }
+    if (b->open && b->open(vb) < 0) {
+        int err = errno;
+        if (vb->fd >= 0) {
+            close(vb->fd);
+        }
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
+
+int vgaball_open(struct vgaball *vb, const char *device, const char *backends) {
+    const struct vgaball_backend *b;
+    char list[128], *name, *save;
+    int err = ENOENT;
+
+    if (backends == NULL) {
+        backends = getenv(VGABALL_ENV);
+    }
+    if (backends == NULL || *backends == '\0' || !strcmp(backends, "auto")) {
+        backends = VGABALL_AUTO;
+    }
+    if (strlen(backends) >= sizeof(list)) {
+        errno = EINVAL;
+        return -1;
+    }
+    strcpy(list, backends);
+
+    for (name = strtok_r(list, ",", &save); name; name = strtok_r(NULL, ",", &save)) {
+        b = find_backend(name);
+        if (b == NULL) {
+            errno = EINVAL;
+            return -1;
+        }
+        if (open_backend(vb, b, device) == 0) {
+            return 0;
+        }
+        err = errno;
+    }
+    errno = err;
+    return -1;
+}
+
+void vgaball_close(struct vgaball *vb) {
+    if (vb->backend->close) {
+        vb->backend->close(vb);
+    }
+    if (vb->fd >= 0) {
+        if (vb->staging) {
+            vga_ball_staging_unmap(vb->staging);
+        }
+        close(vb->fd);
+    }
+    vb->fd = -1;
+    vb->staging = NULL;
+}
+
+const char *vgaball_backend_name(const struct vgaball *vb) {
+    return vb->backend->name;
+}
+
+int vgaball_config(struct vgaball *vb, vga_ball_config_t *config) {
+    static const vga_ball_config_t built = VGA_BALL_CONFIG_INIT;
+
+    if (vb->fd < 0) {
+        *config = built;
+        return 0;
+    }
+    return ioctl(vb->fd, VGA_BALL_READ_CONFIG, config);
+}
+
+int vgaball_frame(struct vgaball *vb, const vga_ball_frame_t *frame) {
+    return vb->backend->frame(vb, frame);
+}
+
+int vgaball_sprites(struct vgaball *vb, const vga_ball_sprites_t *sprites) {
+    return vb->backend->sprites(vb, sprites);
+}
+
+int vgaball_palette(struct vgaball *vb, unsigned int first, unsigned int count,
+                    const unsigned int *colors) {
+    vga_ball_palette_t pal;
+
+    if (count > VGA_BALL_PALETTE_SIZE) {
+        errno = EINVAL;
+        return -1;
+    }
+    pal.first = first;
+    pal.count = count;
+    memcpy(pal.colors, colors, count * sizeof(*colors));
+    return vb->backend->palette(vb, &pal);
+}
+
+void *vgaball_staging(struct vgaball *vb) {
+    if (vb->staging == NULL) {
+        vb->staging = vb->backend->staging(vb);
+    }
+    return vb->staging;
+}
+
+int vgaball_upload(struct vgaball *vb, unsigned int offset, unsigned int src,
+                   unsigned int len) {
+    vga_ball_upload_t up = { offset, src, len };
+    return vb->backend->upload(vb, &up);
+}
+
+int vgaball_present(struct vgaball *vb) {
+    return vb->backend->present ? vb->backend->present(vb) : 0;
+}
+
+unsigned int vgaball_get_field(const vga_ball_frame_t *frame, unsigned int field) {
+    switch (field) {
+    case VGA_BALL_FIELD_X:          return frame->position.xcoor;
+    case VGA_BALL_FIELD_Y:          return frame->position.ycoor;
+    case VGA_BALL_FIELD_RED:        return frame->background.red;
+    case VGA_BALL_FIELD_GREEN:      return frame->background.green;
+    case VGA_BALL_FIELD_BLUE:       return frame->background.blue;
+    case VGA_BALL_FIELD_SCROLL:     return frame->scroll_x;
+    case VGA_BALL_FIELD_BALL_FRAME: return frame->ball_frame;
+    case VGA_BALL_FIELD_BG_INDEX:   return frame->bg_index;
+    default:                        return 0;
+    }
+}
+
+void vgaball_set_field(vga_ball_frame_t *frame, unsigned int field, unsigned int value) {
+    switch (field) {
+    case VGA_BALL_FIELD_X:          frame->position.xcoor = value; break;
+    case VGA_BALL_FIELD_Y:          frame->position.ycoor = value; break;
+    case VGA_BALL_FIELD_RED:        frame->background.red = value; break;
+    case VGA_BALL_FIELD_GREEN:      frame->background.green = value; break;
+    case VGA_BALL_FIELD_BLUE:       frame->background.blue = value; break;
+    case VGA_BALL_FIELD_SCROLL:     frame->scroll_x = value; break;
+    case VGA_BALL_FIELD_BALL_FRAME: frame->ball_frame = value; break;
+    case VGA_BALL_FIELD_BG_INDEX:   frame->bg_index = value; break;
+    default:                        return;
+    }
+    frame->dirty |= 1u << field;
+}
@@ -0,0 +1,98 @@
+/*
+ * libvgaball: one interface to the display, over interchangeable ways of
+ * reaching it.
+ *
+ *   ioctl  VGA_BALL_WRITE_POS and VGA_BALL_WRITE_BACKGROUND, one call each
+ *   frame  every field of an update in one VGA_BALL_WRITE_FRAME
+ *   write  vga_ball_update_t records through write()
+ *   ring   the mmap()ed command ring: no system call per update
+ *   mmap   straight to the registers: no system call and no vblank sync
+ *   null   no device at all; accepts everything and shows nothing
+ *   sim    no device either; renders each frame into memory
+ *
+ * Which one is used is a configuration string, not a code change: a
+ * comma-separated list of backends to try in order, or "auto".
+ */
+
+#ifndef _VGABALL_H
+#define _VGABALL_H
+
+#include "vga_ball.h"
+#include "vga_ball_mmap.h"
+
+/* What "auto" tries: the vblank-synchronized paths, cheapest first */
+#define VGABALL_AUTO   "ring,write,frame,ioctl"
+
+/* Backends to use when vgaball_open() is given none */
+#define VGABALL_ENV    "VGABALL_BACKEND"
+
+/* Where the sim backend sends its frames, and how often it renders one */
+#define VGABALL_SIM_PPM   "VGABALL_SIM_PPM"
+#define VGABALL_SIM_EVERY "VGABALL_SIM_EVERY"
+
+struct vgaball_backend;
+
+struct vgaball {
+    const struct vgaball_backend *backend;
+    int fd;                  // the open device, or -1
+    unsigned int caps;       // VGA_BALL_CAP_*
+    vga_ball_mmio_t mmio;    // register mapping, mmap backend only
+    vga_ball_ring_t *ring;   // command ring, ring backend only
+    void *staging;           // upload staging buffer, once asked for
+    void *priv;              // backend state
+};
+
+/*
+ * Open the display at device through the first of backends that works
+ * there; NULL means $VGABALL_BACKEND, or "auto" without it.  Returns 0,
+ * or -1 with errno set by the last backend tried.
+ */
+int vgaball_open(struct vgaball *vb, const char *device, const char *backends);
+void vgaball_close(struct vgaball *vb);
+
+const char *vgaball_backend_name(const struct vgaball *vb);
+
+/*
+ * The device, for waiting on vblanks with read(), poll() and
+ * VGA_BALL_WAIT_VSYNC, or -1 if there isn't one.
+ */
+static inline int vgaball_fd(const struct vgaball *vb) {
+    return vb->fd;
+}
+
+/*
+ * What the display was built for: the driver's VGA_BALL_READ_CONFIG, or
+ * this build's VGA_BALL_CONFIG_INIT with no device.  Returns 0, or -1
+ * with errno set (ENOTTY: the driver is too old to say).
+ */
+int vgaball_config(struct vgaball *vb, vga_ball_config_t *config);
+
+/* Send the fields named in frame->dirty; returns 0 or -1 with errno set */
+int vgaball_frame(struct vgaball *vb, const vga_ball_frame_t *frame);
+
+/* Sprite table entries and palette entries; 0 or -1 with errno set */
+int vgaball_sprites(struct vgaball *vb, const vga_ball_sprites_t *sprites);
+int vgaball_palette(struct vgaball *vb, unsigned int first, unsigned int count,
+                    const unsigned int *colors);
+
+/*
+ * The VGA_BALL_STAGING_SIZE byte staging buffer, and a copy of len bytes
+ * at src in it to device memory at offset.  Each upload is done before
+ * vgaball_upload() returns, so the buffer can be refilled straight away.
+ */
+void *vgaball_staging(struct vgaball *vb);
+int vgaball_upload(struct vgaball *vb, unsigned int offset, unsigned int src,
+                   unsigned int len);
+
+/*
+ * A frame is done: everything for it has been sent.  Devices show each
+ * update as it lands, so this only matters to backends that draw frames
+ * themselves; returns 0 or -1 with errno set.
+ */
+int vgaball_present(struct vgaball *vb);
+
+/* A frame's field by VGA_BALL_FIELD_* number; setting one marks it dirty */
+unsigned int vgaball_get_field(const vga_ball_frame_t *frame, unsigned int field);
+void vgaball_set_field(vga_ball_frame_t *frame, unsigned int field, unsigned int value);
+
+#endif
@@ -0,0 +1,202 @@
+/*
+ * Obstacle pool, scrolling and collisions
+ *
+ * Nothing here allocates: obstacles come from a fixed pool tracked by a
+ * bitmask, and the column buckets are rebuilt in place each tick, which
+ * costs one or two bit sets per live obstacle.
+ */
+
+#include <string.h>
+#include "world.h"
+
+#define SPEED_START  Q16(4)
+#define SPEED_MAX    Q16(10)
+#define SPEED_STEP   (Q16(1) / 1024)     // gained every tick
+
+/*
+ * Ticks between spawns.  At least a full jump, so there is always time to
+ * land before the next one arrives.
+ */
+#define SPAWN_MIN    (MOVE_TICKS + 8)
+#define SPAWN_RANGE  (TICK_HZ * 3 / 2)
+
+static unsigned int xorshift32(unsigned int *state) {
+    unsigned int x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return *state = x;
+}
+
+void world_init(struct world *w, int ground, unsigned int seed) {
+    memset(w, 0, sizeof(*w));
+    w->ground = ground;
+    w->speed = SPEED_START;
+    w->rng = seed ? seed : 1;
+    w->next_spawn = SPAWN_MIN;
+}
+
+static void spawn(struct world *w) {
+    unsigned int r = xorshift32(&w->rng);
+    struct obstacle *o;
+
+    if (w->active == (1U << WORLD_MAX_OBSTACLES) - 1) {
+        return;                          // pool full, skip this one
+    }
+    o = &w->obs[__builtin_ctz(~w->active)];
+    w->active |= 1U << (o - w->obs);
+
+    o->x = Q16(WORLD_WIDTH);
+    switch (r & 3) {
+    case 0:
+        // Bird at head height: duck under it, or jump high
+        o->w = WORLD_TILE;
+        o->h = WORLD_TILE / 2;
+        o->y = w->ground - WORLD_TILE - o->h / 2;
+        o->tile = ART_BIRD0;
+        break;
+    case 1:
+        // Tall cactus: needs a full jump
+        o->w = WORLD_TILE - 8;
+        o->h = WORLD_TILE;
+        o->y = w->ground - o->h;
+        o->tile = ART_TALL_CACTUS;
+        break;
+    default:
+        // Small cactus: a short hop will do
+        o->w = WORLD_TILE - 12;
+        o->h = WORLD_TILE - 12;
+        o->y = w->ground - o->h;
+        o->tile = ART_CACTUS;
+        break;
+    }
+}
+
+/* Put obstacle i into the buckets of every column it overlaps */
+static void bucket(struct world *w, int i) {
+    int x = q16_trunc(w->obs[i].x);
+    int first = x / WORLD_TILE;
+    int last = (x + w->obs[i].w - 1) / WORLD_TILE;
+
+    if (first < 0) {
+        first = 0;
+    }
+    if (last >= WORLD_COLS) {
+        last = WORLD_COLS - 1;
+    }
+    for (int c = first; c <= last; c++) {
+        w->column[c] |= 1U << i;
+    }
+}
+
+void world_tick(struct world *w) {
+    unsigned int live = w->active;
+
+    memset(w->column, 0, sizeof(w->column));
+    while (live) {
+        int i = __builtin_ctz(live);
+        live &= live - 1;
+
+        w->obs[i].x -= w->speed;
+        if (q16_trunc(w->obs[i].x) + w->obs[i].w <= 0) {
+            w->active &= ~(1U << i);     // scrolled off the left edge
+        } else {
+            bucket(w, i);
+        }
+    }
+
+    // Whole pixels scrolled, in step with the obstacles' sub-pixel x
+    w->travel += w->speed;
+    w->distance += w->travel >> 16;
+    w->travel &= Q16_ONE - 1;
+    if (w->speed < SPEED_MAX) {
+        w->speed += SPEED_STEP;
+    }
+
+    if (--w->next_spawn <= 0) {
+        spawn(w);
+        w->next_spawn = SPAWN_MIN + xorshift32(&w->rng) % SPAWN_RANGE;
+    }
+}
+
+int world_collides(const struct world *w, int x, int y, int width, int height) {
+    int first = x / WORLD_TILE, last = (x + width - 1) / WORLD_TILE;
+    unsigned int near = 0;
+
+    if (x + width <= 0 || x >= WORLD_WIDTH) {
+        return 0;
+    }
+    if (first < 0) {
+        first = 0;
+    }
+    if (last >= WORLD_COLS) {
+        last = WORLD_COLS - 1;
+    }
+    for (int c = first; c <= last; c++) {
+        near |= w->column[c];
+    }
+
+    while (near) {
+        const struct obstacle *o = &w->obs[__builtin_ctz(near)];
+        int ox = q16_trunc(o->x);
+        near &= near - 1;
+
+        if (x < ox + o->w && ox < x + width && y < o->y + o->h && o->y < y + height) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+void world_sprites(const struct world *w, vga_ball_sprites_t *sprites) {
+    sprites->first = 0;
+    sprites->count = WORLD_MAX_OBSTACLES;
+    for (int i = 0; i < WORLD_MAX_OBSTACLES; i++) {
+        vga_ball_sprite_t *s = &sprites->sprites[i];
+        const struct obstacle *o = &w->obs[i];
+
+        if (!(w->active & (1U << i))) {
+            s->flags = 0;
+            continue;
+        }
+        // Hit boxes can be smaller than the tile; center the sprite on them
+        s->xcoor = q16_trunc(o->x) - (WORLD_TILE - o->w) / 2;
+        s->ycoor = o->y - (WORLD_TILE - o->h) / 2;
+        s->tile = o->tile;
+        if (o->tile == ART_BIRD0 && (w->distance / WORLD_TILE) & 1) {
+            s->tile = ART_BIRD1;         // flap as it goes
+        }
+        s->flags = VGA_BALL_SPRITE_ENABLE;
+    }
+}
+
+/* Scatter speckles of ink over a tile's rows first .. last */
+static void speckle(unsigned char *tile, int first, int last, unsigned int *rng) {
+    for (int row = first; row <= last; row++) {
+        for (int col = 0; col < VGA_BALL_TILE_SIZE; col++) {
+            if (xorshift32(rng) % 16 == 0) {
+                tile[row * VGA_BALL_TILE_SIZE + col] = ART_INK;
+            }
+        }
+    }
+}
+
+void world_ground(const struct world *w, unsigned char *map, unsigned char *tiles) {
+    unsigned int rng = 0x2545f491;      // same ground every game
+    int ground_row = w->ground / VGA_BALL_TILE_SIZE;
+
+    memset(tiles, 0, WORLD_BG_TILES * VGA_BALL_TILE_BYTES);
+    // Ground: a two-pixel line on top of some dirt
+    memset(tiles + WORLD_BG_GROUND * VGA_BALL_TILE_BYTES, ART_INK, 2 * VGA_BALL_TILE_SIZE);
+    speckle(tiles + WORLD_BG_GROUND * VGA_BALL_TILE_BYTES, 4, VGA_BALL_TILE_SIZE - 1, &rng);
+    speckle(tiles + WORLD_BG_DIRT * VGA_BALL_TILE_BYTES, 0, VGA_BALL_TILE_SIZE - 1, &rng);
+    speckle(tiles + (WORLD_BG_DIRT + 1) * VGA_BALL_TILE_BYTES, 0, VGA_BALL_TILE_SIZE - 1, &rng);
+
+    memset(map, 0, VGA_BALL_TILEMAP_ROWS * VGA_BALL_TILEMAP_COLS);
+    for (int row = ground_row; row < VGA_BALL_TILEMAP_ROWS; row++) {
+        for (int col = 0; col < VGA_BALL_TILEMAP_COLS; col++) {
+            map[row * VGA_BALL_TILEMAP_COLS + col] =
+                row == ground_row ? WORLD_BG_GROUND : WORLD_BG_DIRT + (xorshift32(&rng) & 1);
+        }
+    }
+}
@@ -0,0 +1,69 @@
+/*
+ * The game world: obstacles that scroll in from the right and have to be
+ * jumped or ducked.  Obstacles live in a fixed pool, one sprite each, and
+ * are bucketed by tile column every tick so a collision test only looks
+ * at the obstacles in the columns it overlaps.
+ */
+
+#ifndef _WORLD_H
+#define _WORLD_H
+
+#include "motion.h"
+#include "vga_ball.h"
+#include "art.h"
+
+#define WORLD_WIDTH   VGA_BALL_WIDTH
+#define WORLD_HEIGHT  VGA_BALL_HEIGHT
+#define WORLD_TILE    VGA_BALL_TILE_SIZE
+#define WORLD_COLS    (WORLD_WIDTH / WORLD_TILE)
+
+#define WORLD_MAX_OBSTACLES 16           // <= VGA_BALL_MAX_SPRITES, and bits in a column mask
+
+/* Tilemap layer tiles for the ground; tile 0 is left empty */
+#define WORLD_BG_GROUND  1
+#define WORLD_BG_DIRT    2               // two variants, 2 and 3
+#define WORLD_BG_TILES   4
+
+struct obstacle {
+    q16_t x;                 // left edge, sub-pixel so slow speeds scroll smoothly
+    short y;                 // top edge
+    unsigned char w, h;      // hit box, from the top-left corner
+    unsigned char tile;      // ART_* pattern
+};
+
+struct world {
+    struct obstacle obs[WORLD_MAX_OBSTACLES];
+    unsigned int active;                 // bit i: obs[i] is in use
+    unsigned int column[WORLD_COLS];     // bit i: obs[i] overlaps the column
+    int ground;                          // y of the ground obstacles stand on
+    q16_t speed;                         // scroll speed, pixels per tick
+    q16_t travel;                        // fraction of a pixel scrolled
+    int next_spawn;                      // ticks until the next obstacle
+    unsigned int rng;                    // xorshift32 state
+    unsigned long distance;              // pixels scrolled, the score
+};
+
+void world_init(struct world *w, int ground, unsigned int seed);
+
+/* Scroll by one tick, retiring obstacles that leave and spawning new ones */
+void world_tick(struct world *w);
+
+/* Does the box at x, y of size width x height hit any obstacle? */
+int world_collides(const struct world *w, int x, int y, int width, int height);
+
+/* Sprite entries 0 .. WORLD_MAX_OBSTACLES - 1 for the current obstacles */
+void world_sprites(const struct world *w, vga_ball_sprites_t *sprites);
+
+/*
+ * Draw the ground into a tilemap (VGA_BALL_TILEMAP_ROWS x _COLS bytes) and
+ * its tile patterns (WORLD_BG_TILES x VGA_BALL_TILE_BYTES), laid out as the
+ * hardware wants them.  The ground scrolls along with the obstacles when
+ * the scroll offset is world_scroll_x().
+ */
+void world_ground(const struct world *w, unsigned char *map, unsigned char *tiles);
+
+static inline unsigned int world_scroll_x(const struct world *w) {
+    return w->distance % (VGA_BALL_TILEMAP_COLS * VGA_BALL_TILE_SIZE);
+}
+
+#endif